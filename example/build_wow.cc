@@ -6,7 +6,7 @@
 int main(int argc, char **argv)
 {
   size_t      m, efc, dim, maxN;
-  std::string basevec, baseatt, space, index_location;
+  std::string basevec, baseatt, space, index_location, quantize;
   int         t;
   size_t      o = 4, wp = 0;
 
@@ -29,6 +29,8 @@ int main(int argc, char **argv)
       o = std::stoul(argv[++i]);
     } else if (strcmp(argv[i], "--wp") == 0) {
       wp = std::stoul(argv[++i]);
+    } else if (strcmp(argv[i], "--quantize") == 0) {
+      quantize = argv[++i];
     } else {
       throw std::runtime_error("unknown argument: " + std::string(argv[i]));
     }
@@ -57,6 +59,10 @@ int main(int argc, char **argv)
   }
   auto end = std::chrono::high_resolution_clock::now();
   std::cout << "Index built in " << std::chrono::duration<double>(end - start).count() << " seconds" << std::endl;
+  if (!quantize.empty()) {
+    index.quantize(quantize);
+    std::cout << "Index quantized with " << quantize << std::endl;
+  }
   // save index
   index.save(index_location);
   std::cout << "Index saved to: " << index_location << std::endl;
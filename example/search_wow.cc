@@ -6,7 +6,7 @@
 int main(int argc, char **argv)
 {
   std::string quer_vec, query_rng, gt_file, index_location, space;
-  size_t      k;
+  size_t      k, threads = 0;
   for (int i = 1; i < argc; ++i) {
     if (strcmp(argv[i], "--query_vec") == 0) {
       quer_vec = argv[++i];
@@ -20,6 +20,8 @@ int main(int argc, char **argv)
       index_location = argv[++i];
     } else if (strcmp(argv[i], "--space") == 0) {
       space = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      threads = std::stoul(argv[++i]);
     }else{
       throw std::runtime_error("unknown argument: " + std::string(argv[i]));
     }
@@ -52,13 +54,30 @@ int main(int argc, char **argv)
     float avg_hops = 0;
     index.metric_dist_comps_ = 0;
     index.metric_hops_ = 0;
-    for (size_t i = 0; i < nq; ++i) {
+    if (threads > 0) {
+      // batched search, metrics are not thread safe and only meaningful with --threads 1
+      std::vector<wowlib::label_t> labels(nq * k);
+      std::vector<wowlib::dist_t>  dists(nq * k);
       auto start = std::chrono::high_resolution_clock::now();
-      auto result = index.searchKNN(query_vecs + i * d, efs, k, query_filters[i]);
+      index.searchKNNBatch(query_vecs, nq, efs, k, query_filters.data(), labels.data(), dists.data(), threads);
       auto end   = std::chrono::high_resolution_clock::now();
       time += std::chrono::duration<float>(end - start).count();
-      for(auto &r : result) {
-        results[i].emplace_back(r.second);
+      for (size_t i = 0; i < nq; ++i) {
+        for (size_t j = 0; j < k; ++j) {
+          if (labels[i * k + j] != std::numeric_limits<wowlib::label_t>::max()) {
+            results[i].emplace_back(labels[i * k + j]);
+          }
+        }
+      }
+    } else {
+      for (size_t i = 0; i < nq; ++i) {
+        auto start = std::chrono::high_resolution_clock::now();
+        auto result = index.searchKNN(query_vecs + i * d, efs, k, query_filters[i]);
+        auto end   = std::chrono::high_resolution_clock::now();
+        time += std::chrono::duration<float>(end - start).count();
+        for(auto &r : result) {
+          results[i].emplace_back(r.second);
+        }
       }
     }
     float recall = benchmark::CalculateRecall(gt,results);
@@ -14,6 +14,13 @@ from ._pywowlib_core import (
     _WoWIndexDoubleAttr, _WoWRangeFilterDoubleAttr, _WoWSetFilterDoubleAttr,
     _FixedString16, _WoWIndexString16Attr, _WoWRangeFilterString16Attr, _WoWSetFilterString16Attr,
     _FixedString32, _WoWIndexString32Attr, _WoWRangeFilterString32Attr, _WoWSetFilterString32Attr,
+    _WoWIndexInt32AttrFP16, _WoWIndexInt64AttrFP16, _WoWIndexUInt32AttrFP16, _WoWIndexUInt64AttrFP16,
+    _WoWIndexLabelAttrFP16, _WoWIndexFloatAttrFP16, _WoWIndexDoubleAttrFP16,
+    _WoWIndexString16AttrFP16, _WoWIndexString32AttrFP16,
+    _WoWMultiRangeFilterInt32Attr, _WoWMultiRangeFilterInt64Attr,
+    _WoWMultiRangeFilterUInt32Attr, _WoWMultiRangeFilterUInt64Attr, _WoWMultiRangeFilterLabelAttr,
+    _WoWMultiRangeFilterFloatAttr, _WoWMultiRangeFilterDoubleAttr,
+    _WoWMultiRangeFilterString16Attr, _WoWMultiRangeFilterString32Attr,
 )
 
 # --- Public User-Facing Classes and Factories ---
@@ -41,6 +48,40 @@ _INDEX_TYPE_MAPPING = {
     "label": _WoWIndexLabelAttr  # Use LabelAttr instead of UInt64Attr
 }
 
+# indexes storing vectors as float16
+_INDEX_FP16_TYPE_MAPPING = {
+    "int32": _WoWIndexInt32AttrFP16,
+    "int64": _WoWIndexInt64AttrFP16,
+    "uint32": _WoWIndexUInt32AttrFP16,
+    "uint64": _WoWIndexUInt64AttrFP16,
+    "float32": _WoWIndexFloatAttrFP16,
+    "float": _WoWIndexFloatAttrFP16,
+    "double": _WoWIndexDoubleAttrFP16,
+    "float64": _WoWIndexDoubleAttrFP16,
+    "string16": _WoWIndexString16AttrFP16,
+    "string32": _WoWIndexString32AttrFP16,
+    "label": _WoWIndexLabelAttrFP16
+}
+
+_VEC_TYPE_MAPPING = {
+    "float32": _INDEX_TYPE_MAPPING,
+    "float": _INDEX_TYPE_MAPPING,
+    "float16": _INDEX_FP16_TYPE_MAPPING,
+    "half": _INDEX_FP16_TYPE_MAPPING,
+}
+
+
+def _index_class(att_type: str, vec_type: str):
+    index_mapping = _VEC_TYPE_MAPPING.get(vec_type.lower())
+    if index_mapping is None:
+        raise ValueError(f"Unsupported vec_type: '{vec_type}'. Supported: {', '.join(_VEC_TYPE_MAPPING.keys())}")
+    norm_att_type = att_type.lower().replace("_", "").replace("-", "")
+    IndexClass = index_mapping.get(norm_att_type)
+    if IndexClass is None:
+        raise ValueError(f"Unsupported att_type: '{att_type}'. Supported: {', '.join(index_mapping.keys())}")
+    return IndexClass
+
+
 _RANGE_FILTER_MAPPING = {
     "int32": _WoWRangeFilterInt32Attr, "int64": _WoWRangeFilterInt64Attr,
     "uint32": _WoWRangeFilterUInt32Attr, "uint64": _WoWRangeFilterUInt64Attr,
@@ -50,6 +91,15 @@ _RANGE_FILTER_MAPPING = {
     "label": _WoWRangeFilterLabelAttr  # Use LabelAttr instead of UInt64Attr
 }
 
+_MULTI_RANGE_FILTER_MAPPING = {
+    "int32": _WoWMultiRangeFilterInt32Attr, "int64": _WoWMultiRangeFilterInt64Attr,
+    "uint32": _WoWMultiRangeFilterUInt32Attr, "uint64": _WoWMultiRangeFilterUInt64Attr,
+    "float32": _WoWMultiRangeFilterFloatAttr, "float": _WoWMultiRangeFilterFloatAttr,
+    "double": _WoWMultiRangeFilterDoubleAttr, "float64": _WoWMultiRangeFilterDoubleAttr,
+    "string16": _WoWMultiRangeFilterString16Attr, "string32": _WoWMultiRangeFilterString32Attr,
+    "label": _WoWMultiRangeFilterLabelAttr
+}
+
 _SET_FILTER_MAPPING = {
     "int32": _WoWSetFilterInt32Attr, "int64": _WoWSetFilterInt64Attr,
     "uint32": _WoWSetFilterUInt32Attr, "uint64": _WoWSetFilterUInt64Attr,
@@ -62,37 +112,44 @@ _SET_FILTER_MAPPING = {
 
 def WoWIndex(max_elements: int, vec_d: int, M: int, efc: int,
              space_name: str, att_type: str,
-             o: int = 4, wp: int = 11, auto_raise_wp: bool = True):
+             o: int = 4, wp: int = 11, auto_raise_wp: bool = True, vec_type: str = "float32",
+             cache_edge_dists: bool = False, layout: str = "interleaved"):
     """
     Factory to create or load a WoWIndex with a specific POD attribute type.
     Supported att_type: "int32", "int64", "uint32", "uint64",
                         "float32", "float64" (or "float", "double"),
                         "string16", "string32", "label".
+    vec_type="float16" stores vectors in half precision; float32 inputs are converted.
+    cache_edge_dists=True trades (wp + 1) * M floats per element for fewer distance computations while building.
+    layout="split" keeps labels/attributes, vectors and link lists in separate arrays instead of one slot per element.
     """
-    norm_att_type = att_type.lower().replace("_", "").replace("-", "")
-    IndexClass = _INDEX_TYPE_MAPPING.get(norm_att_type)
-
-    if IndexClass is None:
-        raise ValueError(f"Unsupported att_type: '{att_type}'. Supported: {', '.join(_INDEX_TYPE_MAPPING.keys())}")
+    IndexClass = _index_class(att_type, vec_type)
 
-    
     return IndexClass(max_elements=max_elements, vec_d=vec_d, M=M, efc=efc,
-                          space_name=space_name, o=o, wp=wp, auto_raise_wp=auto_raise_wp)
+                          space_name=space_name, o=o, wp=wp, auto_raise_wp=auto_raise_wp,
+                          cache_edge_dists=cache_edge_dists, layout=layout)
     
-def WoWIndexLoad(location: str, space_name: str, att_type: str):
+def WoWIndexLoad(location: str, space_name: str, att_type: str,
+                 use_mmap: bool = False, read_only: bool = True, freeze: bool = False, vec_type: str = "float32",
+                 verify_checksums: bool = True, verify_mapped: bool = False):
     """
     Factory to load a WoWIndex from a file with a specific POD attribute type.
     Supported att_type: "int32", "int64", "uint32", "uint64",
                         "float32", "float64" (or "float", "double"),
                         "string16", "string32", "label".
+    With use_mmap=True the element region is mapped from the file instead of read;
+    read_only=False makes the mapping copy-on-write so the index still accepts inserts.
+    freeze=True loads a read-only index with a lock-free order table (see index.freeze()).
+    vec_type must match the vec_type the index was created with.
+    verify_checksums=False skips the CRC-32C check of the file sections.
+    With use_mmap=True only the small sections (order table, label index, quantizer, hubs) are checked by default:
+    checking the mapped element sections reads every page of the file at load time, which gives up the fast start
+    of mmap. verify_mapped=True checks them too, at that cost; without it a corrupt element section goes unnoticed.
     """
-    norm_att_type = att_type.lower().replace("_", "").replace("-", "")
-    IndexClass = _INDEX_TYPE_MAPPING.get(norm_att_type)
+    IndexClass = _index_class(att_type, vec_type)
 
-    if IndexClass is None:
-        raise ValueError(f"Unsupported att_type: '{att_type}'. Supported: {', '.join(_INDEX_TYPE_MAPPING.keys())}")
-
-    return IndexClass(location=location, space_name=space_name)
+    return IndexClass(location=location, space_name=space_name, use_mmap=use_mmap, read_only=read_only,
+                      freeze=freeze, verify_checksums=verify_checksums, verify_mapped=verify_mapped)
 
 
 def WoWRangeFilter(att_type: str, lower_bound, upper_bound):
@@ -104,6 +161,18 @@ def WoWRangeFilter(att_type: str, lower_bound, upper_bound):
     return FilterClass(lower_bound=lower_bound, upper_bound=upper_bound)
 
 
+def WoWMultiRangeFilter(att_type: str, intervals=()):
+    """Factory for a filter passing the union of the (lower_bound, upper_bound) intervals, see add()."""
+    norm_att_type = att_type.lower().replace("_", "").replace("-", "")
+    FilterClass = _MULTI_RANGE_FILTER_MAPPING.get(norm_att_type)
+    if FilterClass is None:
+        raise ValueError(f"Unsupported att_type for WoWMultiRangeFilter: '{att_type}'.")
+    multi_range = FilterClass()
+    for lower_bound, upper_bound in intervals:
+        multi_range.add(lower_bound, upper_bound)
+    return multi_range
+
+
 def WoWSetFilter(att_type: str, *args):
     """Factory for creating a set filter based on attribute type."""
     norm_att_type = att_type.lower().replace("_", "").replace("-", "")
@@ -116,6 +185,7 @@ def WoWSetFilter(att_type: str, *args):
 __all__ = [
     "WoWIndex",
     "WoWRangeFilter",
+    "WoWMultiRangeFilter",
     "WoWSetFilter",
     "WoWBitsetLabelFilter",
     "WoWBitsetIntFilter",
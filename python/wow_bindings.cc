@@ -64,7 +64,8 @@ struct hash<FixedString<N>>
 }  // namespace std
 
 // --- Type Definitions ---
-using VecType = float;
+using VecType     = float;
+using HalfVecType = wowlib::fp16_t;
 
 // *** Use wowlib namespace qualifier ***
 using LabelType = wowlib::label_t;
@@ -78,8 +79,28 @@ using IndexSequential   = wowlib::WoWIndex<LabelType, VecType>;
 using BitsetLabelFilter = wowlib::wow_bitset<LabelType>;  // LabelType is now defined
 using RangeLabelFilter  = wowlib::wow_range<LabelType>;
 
-// --- Helper function for numpy array checks ---
-void check_numpy_array(const py::array_t<VecType> &arr, const std::string &name, size_t expected_dim)
+// --- Helper functions for numpy array conversion and checks ---
+// vectors in the index element type: float32 is force-cast by pybind11, float16 has no C++ type descriptor in
+// pybind11 and is converted by numpy (no copy if the input already is a contiguous float16 array)
+template <typename VecType>
+py::array as_vec_array(const py::object &obj)
+{
+  if constexpr (std::is_same_v<VecType, float>) {
+    return py::array_t<float, py::array::c_style | py::array::forcecast>::ensure(obj);
+  } else {
+    static_assert(std::is_same_v<VecType, wowlib::fp16_t>, "only float32 and float16 vectors are bound");
+    return py::module_::import("numpy").attr("ascontiguousarray")(obj, "float16").cast<py::array>();
+  }
+}
+
+template <typename VecType>
+const char *vec_dtype_name()
+{
+  return std::is_same_v<VecType, float> ? "float32" : "float16";
+}
+
+template <typename VecType>
+void check_numpy_array(const py::array &arr, const std::string &name, size_t expected_dim)
 {
   if (!arr)
     throw std::runtime_error(name + " cannot be None");
@@ -89,11 +110,12 @@ void check_numpy_array(const py::array_t<VecType> &arr, const std::string &name,
   if ((size_t)buf.shape[0] != expected_dim)
     throw std::runtime_error(
         name + " has dim " + std::to_string(buf.shape[0]) + ", expected " + std::to_string(expected_dim));
-  if (!py::isinstance<py::array_t<VecType>>(arr) || !arr.dtype().is(py::dtype::of<VecType>()))
-    throw std::runtime_error(name + " has incorrect dtype, expected float32");
+  if (!arr.dtype().is(py::dtype(vec_dtype_name<VecType>())))
+    throw std::runtime_error(name + " has incorrect dtype, expected " + vec_dtype_name<VecType>());
 }
+template <typename VecType>
 void check_numpy_array_batch(
-    const py::array_t<VecType> &arr, const std::string &name, size_t expected_num_vectors, size_t expected_vec_dim)
+    const py::array &arr, const std::string &name, size_t expected_num_vectors, size_t expected_vec_dim)
 {
   if (!arr)
     throw std::runtime_error(name + " cannot be None");
@@ -106,21 +128,25 @@ void check_numpy_array_batch(
   if ((size_t)buf.shape[1] != expected_vec_dim)
     throw std::runtime_error(name + " wrong vec_dim. Expected " + std::to_string(expected_vec_dim) + ", got " +
                              std::to_string(buf.shape[1]));
-  if (!py::isinstance<py::array_t<VecType>>(arr) || !arr.dtype().is(py::dtype::of<VecType>()))
-    throw std::runtime_error(name + " has incorrect dtype, expected float32");
+  if (!arr.dtype().is(py::dtype(vec_dtype_name<VecType>())))
+    throw std::runtime_error(name + " has incorrect dtype, expected " + vec_dtype_name<VecType>());
 }
 
 // --- Helper Template Function to Bind WoWIndex and its Associated Filters ---
-template <typename AttType, typename ModuleType>
-void bind_wow_index_specialization(ModuleType &m, const std::string &python_name_suffix)
+// vec_name_suffix tells apart index classes of the same AttType, filters are shared between them
+template <typename AttType, typename VecType, typename ModuleType>
+void bind_wow_index_specialization(
+    ModuleType &m, const std::string &python_name_suffix, const std::string &vec_name_suffix = "")
 {
-  using IndexSpecialized       = wowlib::WoWIndex<AttType, VecType>;
-  using RangeFilterSpecialized = wowlib::wow_range<AttType>;
-  using SetFilterSpecialized   = wowlib::wow_set<AttType>;
+  using IndexSpecialized            = wowlib::WoWIndex<AttType, VecType>;
+  using RangeFilterSpecialized      = wowlib::wow_range<AttType>;
+  using SetFilterSpecialized        = wowlib::wow_set<AttType>;
+  using MultiRangeFilterSpecialized = wowlib::wow_multi_range<AttType>;
 
-  std::string index_class_name        = "_WoWIndex" + python_name_suffix;  // Internal name
-  std::string range_filter_class_name = "_WoWRangeFilter" + python_name_suffix;
-  std::string set_filter_class_name   = "_WoWSetFilter" + python_name_suffix;
+  std::string index_class_name              = "_WoWIndex" + python_name_suffix + vec_name_suffix;  // Internal name
+  std::string range_filter_class_name       = "_WoWRangeFilter" + python_name_suffix;
+  std::string set_filter_class_name         = "_WoWSetFilter" + python_name_suffix;
+  std::string multi_range_filter_class_name = "_WoWMultiRangeFilter" + python_name_suffix;
 
   // --- Bind AttType if it's FixedString ---
   if constexpr (std::is_base_of_v<FixedString<1>, AttType> ||  // Check if AttType is any FixedString<N>
@@ -233,30 +259,149 @@ void bind_wow_index_specialization(ModuleType &m, const std::string &python_name
       return py_set;
     });
   }
+  if (!py::hasattr(m, multi_range_filter_class_name.c_str())) {
+    auto to_att = [](py::object py_attr) -> AttType {
+      if constexpr (std::is_base_of_v<FixedString<1>, AttType> || (std::is_same_v<AttType, FixedString<16>>) ||
+                    (std::is_same_v<AttType, FixedString<32>>)) {
+        if (!py::isinstance<py::str>(py_attr)) {
+          throw py::type_error("Multi-range filter bounds must be strings for FixedString attribute types.");
+        }
+        return AttType(py_attr.cast<std::string>());
+      } else {
+        return py_attr.cast<AttType>();
+      }
+    };
+    py::class_<MultiRangeFilterSpecialized>(m, multi_range_filter_class_name.c_str())
+        .def(py::init<>())
+        .def(
+            "add",
+            [to_att](MultiRangeFilterSpecialized &self, py::object py_lower, py::object py_upper) {
+              self.Add(to_att(py_lower), to_att(py_upper));
+            },
+            py::arg("lower_bound"),
+            py::arg("upper_bound"))
+        .def(
+            "test",
+            [to_att](const MultiRangeFilterSpecialized &self, py::object py_attr) {
+              return self.Test(to_att(py_attr));
+            },
+            py::arg("attribute"))
+        .def_property_readonly("intervals", [](const MultiRangeFilterSpecialized &f) {
+          py::list intervals;
+          for (size_t i = 0; i < f.l_.size(); ++i) {
+            intervals.append(py::make_tuple(py::cast(f.l_[i]), py::cast(f.u_[i])));
+          }
+          return intervals;
+        });
+  }
   // --- Bind WoWIndex Specialization ---
   py::class_<IndexSpecialized>(m, index_class_name.c_str())
-      .def(py::init<size_t, size_t, size_t, size_t, std::string, size_t, size_t, bool>(),
+      .def(py::init([](size_t max_elements, size_t vec_d, size_t M, size_t efc, std::string space_name, size_t o,
+                        size_t wp, bool auto_raise_wp, bool cache_edge_dists, const std::string &layout) {
+        if (layout != "interleaved" && layout != "split") {
+          throw std::runtime_error("layout must be \"interleaved\" or \"split\", got " + layout);
+        }
+        return std::make_unique<IndexSpecialized>(max_elements, vec_d, M, efc, space_name, o, wp, auto_raise_wp,
+            cache_edge_dists, layout == "split" ? wowlib::ElementLayout::kSplit : wowlib::ElementLayout::kInterleaved);
+      }),
           py::arg("max_elements"),
           py::arg("vec_d"),
           py::arg("M"),
           py::arg("efc"),
           py::arg("space_name"),
-          py::arg("o")             = 4,
-          py::arg("wp")            = 10,
-          py::arg("auto_raise_wp") = true)
-      .def(py::init<const std::string &, std::string>(), py::arg("location"), py::arg("space_name"))
+          py::arg("o")                = 4,
+          py::arg("wp")               = 10,
+          py::arg("auto_raise_wp")    = true,
+          py::arg("cache_edge_dists") = false,
+          py::arg("layout")           = "interleaved")
+      .def(py::init([](const std::string &location, std::string space_name, bool use_mmap, bool read_only,
+                        bool freeze, bool verify_checksums, bool verify_mapped) {
+        wowlib::LoadOptions options;
+        options.use_mmap_         = use_mmap;
+        options.read_only_        = use_mmap && read_only;
+        options.freeze_           = freeze;
+        options.verify_checksums_ = verify_checksums;
+        options.verify_mapped_    = verify_mapped;
+        return std::make_unique<IndexSpecialized>(location, space_name, options);
+      }),
+          py::arg("location"),
+          py::arg("space_name"),
+          py::arg("use_mmap")         = false,
+          py::arg("read_only")        = true,
+          py::arg("freeze")           = false,
+          py::arg("verify_checksums") = true,
+          py::arg("verify_mapped")    = false)
       .def("save", &IndexSpecialized::save, py::arg("location"))
+      .def("freeze", &IndexSpecialized::freeze, py::arg("compact_links") = false)
+      .def("IsCompact", &IndexSpecialized::IsCompact)
+      .def("quantize", &IndexSpecialized::quantize, py::arg("type") = "sq8")
+      .def("IsQuantized", &IndexSpecialized::IsQuantized)
+      .def("enableNeighborKeys", &IndexSpecialized::enableNeighborKeys)
+      .def("setExactScanThreshold", &IndexSpecialized::setExactScanThreshold, py::arg("threshold"))
+      .def("getExactScanThreshold", &IndexSpecialized::getExactScanThreshold)
+      .def("calibratePlanner", &IndexSpecialized::calibratePlanner, py::arg("queries") = 32, py::arg("efs") = 100)
+      .def("getPlanCosts",
+          [](const IndexSpecialized &self) {
+            auto   &costs = self.getPlanCosts();
+            py::dict d;
+            d["scan_ns"]   = costs.scan_ns_;
+            d["window_ns"] = costs.window_ns_;
+            d["top_ns"]    = costs.top_ns_;
+            return d;
+          })
+      .def(
+          "setPlanCosts",
+          [](IndexSpecialized &self, double scan_ns, double window_ns, double top_ns) {
+            wowlib::PlanCosts costs;
+            costs.scan_ns_   = scan_ns;
+            costs.window_ns_ = window_ns;
+            costs.top_ns_    = top_ns;
+            self.setPlanCosts(costs);
+          },
+          py::arg("scan_ns"),
+          py::arg("window_ns"),
+          py::arg("top_ns"))
+      .def("getLastPlan",
+          [](IndexSpecialized &self) { return std::string(wowlib::SearchPlanName(self.getLastPlan())); })
+      .def("resizeIndex", &IndexSpecialized::resizeIndex, py::arg("new_max"), py::arg("auto_raise_wp") = true)
+      .def("markDeleted", &IndexSpecialized::markDeleted, py::arg("label"))
+      .def("GetDeletedNum", &IndexSpecialized::GetDeletedNum)
+      .def("contains", &IndexSpecialized::contains, py::arg("label"))
+      .def("getAttribute", &IndexSpecialized::getAttribute, py::arg("label"))
+      .def(
+          "getVector",
+          [](IndexSpecialized &self, LabelType label) -> py::array {
+            py::array vec(py::dtype(vec_dtype_name<VecType>()), {(py::ssize_t)self.GetDimension()});
+            self.getVector(label, static_cast<VecType *>(vec.mutable_data()));
+            return vec;
+          },
+          py::arg("label"))
       .def("GetDimension", &IndexSpecialized::GetDimension)
 
+      .def(
+          "updateAttribute",
+          [](IndexSpecialized &self, LabelType label, py::object py_attr) {
+            if constexpr (std::is_same_v<AttType, FixedString<16>> || std::is_same_v<AttType, FixedString<32>>) {
+              if (!py::isinstance<py::str>(py_attr)) {
+                throw py::type_error("Attribute must be a string for FixedString attribute types.");
+              }
+              self.updateAttribute(label, AttType(py_attr.cast<std::string>()));
+            } else {
+              self.updateAttribute(label, py_attr.cast<AttType>());
+            }
+          },
+          py::arg("label"),
+          py::arg("attribute"))
+
       .def(
           "insert",
           [](IndexSpecialized &self,
               LabelType        label,
-              py::array_t<VecType, py::array::c_style | py::array::forcecast>
-                         vec_np,
-              py::object py_attr,  // <<<< CHANGE: Take py::object for attribute
-              bool       replace_deleted = false) {
-            check_numpy_array(vec_np, "vector", self.GetDimension());
+              py::object       vec_obj,
+              py::object       py_attr,  // <<<< CHANGE: Take py::object for attribute
+              bool             replace_deleted = false) {
+            py::array vec_np = as_vec_array<VecType>(vec_obj);
+            check_numpy_array<VecType>(vec_np, "vector", self.GetDimension());
             py::buffer_info vec_buf = vec_np.request();
 
             // Now, explicitly convert py_attr to AttType
@@ -285,16 +430,16 @@ void bind_wow_index_specialization(ModuleType &m, const std::string &python_name
           "bulk_insert",
           [](IndexSpecialized              &self,
               const std::vector<LabelType> &vector_ids,
-              py::array_t<VecType, py::array::c_style | py::array::forcecast>
-                              vectors_np,
-              const py::list &py_attributes_list,  // <<<< CHANGE: Take py::list of py::object
+              py::object                    vectors_obj,
+              const py::list               &py_attributes_list,  // <<<< CHANGE: Take py::list of py::object
               bool            replace_deleted = false,
               size_t          threads         = 4) {
             size_t num_vectors = vector_ids.size();
             if (py_attributes_list.size() != num_vectors) {
               throw std::runtime_error("vector_ids and attributes_batch size mismatch");
             }
-            check_numpy_array_batch(vectors_np, "vectors_batch", num_vectors, self.GetDimension());
+            py::array vectors_np = as_vec_array<VecType>(vectors_obj);
+            check_numpy_array_batch<VecType>(vectors_np, "vectors_batch", num_vectors, self.GetDimension());
             const VecType *data_ptr = static_cast<const VecType *>(vectors_np.request().ptr);
 
             // Convert Python list of attributes to std::vector<AttType>
@@ -334,12 +479,12 @@ void bind_wow_index_specialization(ModuleType &m, const std::string &python_name
       .def(
           "searchKNN",
           [=](IndexSpecialized &self,
-              py::array_t<VecType, py::array::c_style | py::array::forcecast>
-                         query_vec_np,
-              size_t     efs,
-              size_t     k,
-              py::object filter_py) -> std::vector<std::pair<DistType, LabelType>> {
-            check_numpy_array(query_vec_np, "query_vec", self.GetDimension());
+              py::object        query_vec_obj,
+              size_t            efs,
+              size_t            k,
+              py::object        filter_py) -> std::vector<std::pair<DistType, LabelType>> {
+            py::array query_vec_np = as_vec_array<VecType>(query_vec_obj);
+            check_numpy_array<VecType>(query_vec_np, "query_vec", self.GetDimension());
             const VecType *query_vec_ptr = static_cast<const VecType *>(query_vec_np.request().ptr);
 
             if (py::isinstance<RangeFilterSpecialized>(filter_py)) {
@@ -348,6 +493,9 @@ void bind_wow_index_specialization(ModuleType &m, const std::string &python_name
             } else if (py::isinstance<SetFilterSpecialized>(filter_py)) {
               return self.template searchKNN<SetFilterSpecialized>(
                   query_vec_ptr, efs, k, filter_py.cast<const SetFilterSpecialized &>());
+            } else if (py::isinstance<MultiRangeFilterSpecialized>(filter_py)) {
+              return self.template searchKNN<MultiRangeFilterSpecialized>(
+                  query_vec_ptr, efs, k, filter_py.cast<const MultiRangeFilterSpecialized &>());
             } else if (py::isinstance<BitsetLabelFilter>(filter_py)) {
               if constexpr(!std::is_same_v<AttType, LabelType>) {
                 throw py::type_error(
@@ -365,7 +513,80 @@ void bind_wow_index_specialization(ModuleType &m, const std::string &python_name
           py::arg("query_vec"),
           py::arg("efs"),
           py::arg("k"),
-          py::arg("filter"));
+          py::arg("filter"))
+
+      .def(
+          "searchKNNBatch",
+          [=](IndexSpecialized &self,
+              py::object        queries_obj,
+              size_t            efs,
+              size_t            k,
+              py::object        filters_py,
+              size_t            threads = 0) -> py::tuple {
+            py::array       queries_np  = as_vec_array<VecType>(queries_obj);
+            py::buffer_info queries_buf = queries_np.request();
+            if (queries_buf.ndim != 2)
+              throw std::runtime_error("queries must be 2-D");
+            size_t nq = (size_t)queries_buf.shape[0];
+            check_numpy_array_batch<VecType>(queries_np, "queries", nq, self.GetDimension());
+            const VecType *queries_ptr = static_cast<const VecType *>(queries_buf.ptr);
+
+            py::array_t<LabelType> labels_np(std::vector<py::ssize_t>{(py::ssize_t)nq, (py::ssize_t)k});
+            py::array_t<DistType>  dists_np(std::vector<py::ssize_t>{(py::ssize_t)nq, (py::ssize_t)k});
+            LabelType             *labels_ptr = labels_np.mutable_data();
+            DistType              *dists_ptr  = dists_np.mutable_data();
+
+            if (filters_py.is_none()) {  // no filter
+              std::vector<int>        no_filters(nq, 0);
+              py::gil_scoped_release release_gil;
+              self.searchKNNBatch(queries_ptr, nq, efs, k, no_filters.data(), labels_ptr, dists_ptr, threads);
+              return py::make_tuple(labels_np, dists_np);
+            }
+            py::list filters_list = filters_py.cast<py::list>();
+            if (filters_list.size() != nq) {
+              throw std::runtime_error("queries and filters size mismatch");
+            }
+            if (nq > 0 && py::isinstance<RangeFilterSpecialized>(filters_list[0])) {
+              std::vector<RangeFilterSpecialized> filters(nq);
+              for (size_t i = 0; i < nq; ++i) {
+                if (!py::isinstance<RangeFilterSpecialized>(filters_list[i])) {
+                  throw py::type_error("All filters in a batch must have the same type");
+                }
+                filters[i] = filters_list[i].cast<RangeFilterSpecialized>();
+              }
+              py::gil_scoped_release release_gil;
+              self.searchKNNBatch(queries_ptr, nq, efs, k, filters.data(), labels_ptr, dists_ptr, threads);
+            } else if (nq > 0 && py::isinstance<SetFilterSpecialized>(filters_list[0])) {
+              std::vector<SetFilterSpecialized> filters(nq);
+              for (size_t i = 0; i < nq; ++i) {
+                if (!py::isinstance<SetFilterSpecialized>(filters_list[i])) {
+                  throw py::type_error("All filters in a batch must have the same type");
+                }
+                filters[i] = filters_list[i].cast<SetFilterSpecialized>();
+              }
+              py::gil_scoped_release release_gil;
+              self.searchKNNBatch(queries_ptr, nq, efs, k, filters.data(), labels_ptr, dists_ptr, threads);
+            } else if (nq > 0 && py::isinstance<MultiRangeFilterSpecialized>(filters_list[0])) {
+              std::vector<MultiRangeFilterSpecialized> filters(nq);
+              for (size_t i = 0; i < nq; ++i) {
+                if (!py::isinstance<MultiRangeFilterSpecialized>(filters_list[i])) {
+                  throw py::type_error("All filters in a batch must have the same type");
+                }
+                filters[i] = filters_list[i].cast<MultiRangeFilterSpecialized>();
+              }
+              py::gil_scoped_release release_gil;
+              self.searchKNNBatch(queries_ptr, nq, efs, k, filters.data(), labels_ptr, dists_ptr, threads);
+            } else if (nq > 0) {
+              throw py::type_error(
+                  "Unsupported filter type for batch search on " + std::string(index_class_name.c_str()));
+            }
+            return py::make_tuple(labels_np, dists_np);
+          },
+          py::arg("queries"),
+          py::arg("efs"),
+          py::arg("k"),
+          py::arg("filters") = py::none(),
+          py::arg("threads") = 0);
 }
 
 PYBIND11_MODULE(_pywowlib_core, m)
@@ -374,15 +595,26 @@ PYBIND11_MODULE(_pywowlib_core, m)
 
   // --- Bind Filter Types ---
 
-  bind_wow_index_specialization<int32_t>(m, "Int32Attr");
-  bind_wow_index_specialization<int64_t>(m, "Int64Attr");
-  bind_wow_index_specialization<uint32_t>(m, "UInt32Attr");
-  bind_wow_index_specialization<uint64_t>(m, "UInt64Attr");
-  bind_wow_index_specialization<LabelType>(m, "LabelAttr");  // Add specialization for LabelType
-  bind_wow_index_specialization<float>(m, "FloatAttr");
-  bind_wow_index_specialization<double>(m, "DoubleAttr");
-  bind_wow_index_specialization<AttString16>(m, "String16Attr");
-  bind_wow_index_specialization<AttString32>(m, "String32Attr");
+  bind_wow_index_specialization<int32_t, VecType>(m, "Int32Attr");
+  bind_wow_index_specialization<int64_t, VecType>(m, "Int64Attr");
+  bind_wow_index_specialization<uint32_t, VecType>(m, "UInt32Attr");
+  bind_wow_index_specialization<uint64_t, VecType>(m, "UInt64Attr");
+  bind_wow_index_specialization<LabelType, VecType>(m, "LabelAttr");  // Add specialization for LabelType
+  bind_wow_index_specialization<float, VecType>(m, "FloatAttr");
+  bind_wow_index_specialization<double, VecType>(m, "DoubleAttr");
+  bind_wow_index_specialization<AttString16, VecType>(m, "String16Attr");
+  bind_wow_index_specialization<AttString32, VecType>(m, "String32Attr");
+
+  // float16 vector storage, same attribute types and filters
+  bind_wow_index_specialization<int32_t, HalfVecType>(m, "Int32Attr", "FP16");
+  bind_wow_index_specialization<int64_t, HalfVecType>(m, "Int64Attr", "FP16");
+  bind_wow_index_specialization<uint32_t, HalfVecType>(m, "UInt32Attr", "FP16");
+  bind_wow_index_specialization<uint64_t, HalfVecType>(m, "UInt64Attr", "FP16");
+  bind_wow_index_specialization<LabelType, HalfVecType>(m, "LabelAttr", "FP16");
+  bind_wow_index_specialization<float, HalfVecType>(m, "FloatAttr", "FP16");
+  bind_wow_index_specialization<double, HalfVecType>(m, "DoubleAttr", "FP16");
+  bind_wow_index_specialization<AttString16, HalfVecType>(m, "String16Attr", "FP16");
+  bind_wow_index_specialization<AttString32, HalfVecType>(m, "String32Attr", "FP16");
 
   // wow_bitset<label_t>
   py::class_<BitsetLabelFilter>(m, "_WoWBitsetLabelFilter")
@@ -2,6 +2,22 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <streambuf>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
 namespace wowlib{
 
@@ -15,4 +31,324 @@ static void ReadBinaryPOD(std::istream &in, T &podRef) {
     in.read((char *) &podRef, sizeof(T));
 }
 
-} // namespace spatt
\ No newline at end of file
+/**
+ * @brief map a whole file into memory
+ *
+ * @param writable false: PROT_READ shared mapping, true: MAP_PRIVATE copy-on-write mapping
+ * @param hugepage advise MADV_HUGEPAGE (only effective on file systems supporting it)
+ * @param willneed advise MADV_WILLNEED to start readahead of the whole file
+ */
+static auto MapFile(const std::string &location, bool writable, bool hugepage, bool willneed, size_t &OUT_len) -> char *
+{
+    int fd = open(location.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open index file: " + location);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("Failed to stat index file: " + location);
+    }
+    OUT_len    = st.st_size;
+    int  prot  = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    int  flags = writable ? MAP_PRIVATE : MAP_SHARED;
+    auto base  = mmap(nullptr, OUT_len, prot, flags, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("Failed to mmap index file: " + location);
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugepage && MADV_HUGEPAGE != 0) {
+        madvise(base, OUT_len, MADV_HUGEPAGE);
+    }
+#endif
+    if (willneed) {
+        madvise(base, OUT_len, MADV_WILLNEED);
+    }
+    return (char *)base;
+}
+
+/**
+ * @brief CRC-32C (Castagnoli) of n bytes, continuing from crc (start with 0)
+ *
+ * uses the SSE4.2 crc32 instruction when available, a byte table otherwise.
+ */
+static auto Crc32c(uint32_t crc, const char *data, size_t n) -> uint32_t
+{
+    crc = ~crc;
+#ifdef __SSE4_2__
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, data += 8) {
+        uint64_t v;
+        memcpy(&v, data, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t) c;
+    for (; n > 0; --n, ++data) {
+        crc = _mm_crc32_u8(crc, (uint8_t) *data);
+    }
+#else
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (; n > 0; --n, ++data) {
+        crc = table[(crc ^ (uint8_t) *data) & 0xff] ^ (crc >> 8);
+    }
+#endif
+    return ~crc;
+}
+
+/**
+ * @brief type tag stored in the file header, so an index is not loaded with a different label/attribute/vector type
+ *
+ * kind in the upper 16 bits (0 signed integer, 1 unsigned integer, 2 floating point, 3 other), size in the lower.
+ * types of the same size and kind with a different encoding specialize TypeKind.
+ */
+template<typename T>
+struct TypeKind {
+    static constexpr uint32_t value = std::is_floating_point_v<T> ? 2
+                                    : std::is_integral_v<T>       ? (std::is_signed_v<T> ? 0 : 1)
+                                                                  : 3;
+};
+
+template<typename T>
+static constexpr auto TypeTag() -> uint32_t {
+    return TypeKind<T>::value << 16 | (uint32_t) sizeof(T);
+}
+
+// one entry of the section table of an index file
+struct SectionEntry {
+    uint32_t id_{0};
+    uint32_t crc_{0};
+    uint64_t offset_{0};
+    uint64_t size_{0};
+};
+
+// forwards writes to sink and keeps the CRC-32C and the count of what went through
+class Crc32cOutBuf : public std::streambuf {
+public:
+    explicit Crc32cOutBuf(std::streambuf *sink) : sink_(sink) {}
+
+    void Reset() {
+        crc_ = 0;
+        count_ = 0;
+    }
+
+    auto Crc() const -> uint32_t { return crc_; }
+    auto Count() const -> uint64_t { return count_; }
+
+protected:
+    auto xsputn(const char *s, std::streamsize n) -> std::streamsize override {
+        auto written = sink_->sputn(s, n);
+        crc_ = Crc32c(crc_, s, written);
+        count_ += written;
+        return written;
+    }
+
+    auto overflow(int_type c) -> int_type override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        char ch = traits_type::to_char_type(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+
+private:
+    std::streambuf *sink_;
+    uint32_t crc_{0};
+    uint64_t count_{0};
+};
+
+// reads at most limit bytes from source and keeps the CRC-32C of what was read, large reads bypass the buffer
+class Crc32cInBuf : public std::streambuf {
+public:
+    Crc32cInBuf(std::streambuf *source, uint64_t limit) : source_(source), left_(limit) {}
+
+    auto Crc() const -> uint32_t { return crc_; }
+
+    // read and checksum the rest, true if the whole limit was available
+    auto Drain() -> bool {
+        while (underflow() != traits_type::eof()) {
+            setg(buf_, egptr(), egptr());
+        }
+        return left_ == 0;
+    }
+
+protected:
+    auto underflow() -> int_type override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        auto n = source_->sgetn(buf_, (std::streamsize) std::min<uint64_t>(sizeof(buf_), left_));
+        if (n <= 0) {
+            return traits_type::eof();
+        }
+        crc_ = Crc32c(crc_, buf_, n);
+        left_ -= n;
+        setg(buf_, buf_, buf_ + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    auto xsgetn(char *s, std::streamsize n) -> std::streamsize override {
+        std::streamsize done = std::min<std::streamsize>(n, egptr() - gptr());
+        if (done > 0) {
+            memcpy(s, gptr(), done);
+            gbump((int) done);
+        }
+        if (n - done >= (std::streamsize) sizeof(buf_)) {
+            auto direct = source_->sgetn(s + done, (std::streamsize) std::min<uint64_t>(n - done, left_));
+            if (direct > 0) {
+                crc_ = Crc32c(crc_, s + done, direct);
+                left_ -= direct;
+                done += direct;
+            }
+            return done;
+        }
+        return done + std::streambuf::xsgetn(s + done, n - done);
+    }
+
+private:
+    std::streambuf *source_;
+    uint64_t left_;
+    uint32_t crc_{0};
+    char buf_[1 << 16];
+};
+
+/**
+ * @brief writes the sections of an index file, each starting on a 64 byte boundary so it can be mapped
+ *
+ * Begin returns the stream for the section content, End records its size and checksum. WriteTable appends the
+ * section table and returns its offset.
+ */
+class SectionWriter {
+public:
+    explicit SectionWriter(std::ostream &os) : os_(os), buf_(os.rdbuf()), stream_(&buf_) {}
+
+    auto Begin(uint32_t id) -> std::ostream & {
+        Align();
+        sections_.push_back({id, 0, (uint64_t) os_.tellp(), 0});
+        buf_.Reset();
+        return stream_;
+    }
+
+    void End() {
+        stream_.flush();
+        sections_.back().crc_ = buf_.Crc();
+        sections_.back().size_ = buf_.Count();
+        if (!stream_) {
+            throw std::runtime_error("Failed to write index section " + std::to_string(sections_.back().id_));
+        }
+    }
+
+    auto WriteTable() -> uint64_t {
+        Align();
+        uint64_t offset = os_.tellp();
+        for (auto &section : sections_) {
+            WriteBinaryPOD(os_, section);
+        }
+        return offset;
+    }
+
+    auto Count() const -> uint64_t { return sections_.size(); }
+
+private:
+    void Align() {
+        size_t pos = os_.tellp();
+        std::string padding((pos + 63) / 64 * 64 - pos, '\0');
+        os_.write(padding.data(), padding.size());
+    }
+
+    std::ostream &os_;
+    Crc32cOutBuf buf_;
+    std::ostream stream_;
+    std::vector<SectionEntry> sections_;
+};
+
+/**
+ * @brief reads the section table of an index file and hands out bounded, checksummed streams over sections
+ *
+ * a section extending past the end of the file (a truncated copy) is rejected when the table is read.
+ */
+class SectionReader {
+public:
+    // verify checks the sections streamed through Open, verify_mapped the ones passed to Verify
+    SectionReader(std::istream &is, uint64_t file_size, bool verify, bool verify_mapped)
+        : is_(is), file_size_(file_size), verify_(verify), verify_mapped_(verify_mapped) {}
+
+    void ReadTable(uint64_t offset, uint64_t count) {
+        if (offset + count * sizeof(SectionEntry) > file_size_) {
+            throw std::runtime_error("possible index file corruption, file is shorter than the section table (truncated?)");
+        }
+        is_.seekg(offset);
+        sections_.resize(count);
+        for (auto &section : sections_) {
+            ReadBinaryPOD(is_, section);
+            if (section.offset_ + section.size_ > file_size_ || section.offset_ + section.size_ < section.offset_) {
+                throw std::runtime_error("possible index file corruption, section " + std::to_string(section.id_) +
+                                         " extends past the end of the file (truncated?)");
+            }
+        }
+        if (!is_) {
+            throw std::runtime_error("possible index file corruption, failed to read the section table");
+        }
+    }
+
+    auto Find(uint32_t id) const -> const SectionEntry * {
+        for (auto &section : sections_) {
+            if (section.id_ == id) {
+                return &section;
+            }
+        }
+        return nullptr;
+    }
+
+    // stream over the content of section, valid until Close
+    auto Open(const SectionEntry &section) -> std::istream & {
+        is_.clear();
+        is_.seekg(section.offset_);
+        open_ = &section;
+        buf_ = std::make_unique<Crc32cInBuf>(is_.rdbuf(), section.size_);
+        stream_ = std::make_unique<std::istream>(buf_.get());
+        return *stream_;
+    }
+
+    // throws if the section could not be read completely or its checksum does not match
+    void Close() {
+        bool ok = !stream_->fail() && buf_->Drain();
+        if (!ok || (verify_ && buf_->Crc() != open_->crc_)) {
+            throw std::runtime_error("possible index file corruption, " +
+                                     std::string(ok ? "checksum mismatch" : "failed to read") + " in section " +
+                                     std::to_string(open_->id_));
+        }
+        stream_.reset();
+        buf_.reset();
+    }
+
+    // checksum of a section already in memory, e.g. mapped
+    void Verify(const SectionEntry &section, const char *data) const {
+        if (verify_mapped_ && Crc32c(0, data, section.size_) != section.crc_) {
+            throw std::runtime_error("possible index file corruption, checksum mismatch in section " +
+                                     std::to_string(section.id_));
+        }
+    }
+
+private:
+    std::istream &is_;
+    uint64_t file_size_;
+    bool verify_;
+    bool verify_mapped_;
+    std::vector<SectionEntry> sections_;
+    const SectionEntry *open_{nullptr};
+    std::unique_ptr<Crc32cInBuf> buf_;
+    std::unique_ptr<std::istream> stream_;
+};
+
+} // namespace spatt
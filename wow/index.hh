@@ -1,8 +1,25 @@
 #pragma once
+#include <thread>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <array>
+#include <atomic>
+#include <sstream>
+#include <chrono>
+#include <optional>
+#include <deque>
+#include <unordered_map>
 #include "disk.hh"
 #include "utils.hh"
+#include "key_filter.hh"
 #include "order_table.hh"
+#include "label_index.hh"
+#include "segmented_storage.hh"
+#include "quantizer.hh"
 #include "visit_list.hh"
+#include "search_context.hh"
+#include "query_planner.hh"
 #include "space_dist.hh"
 #include "memory.hh"
 
@@ -12,27 +29,55 @@ namespace wowlib {
   (std::is_same_v<filter_type, wowlib::wow_range<att_type>> ||                 \
       std::is_same_v<filter_type, wowlib::wow_range<att_label_t<att_type>>> || \
       std::is_same_v<filter_type, wowlib::wow_set<att_type>> ||                \
+      std::is_same_v<filter_type, wowlib::wow_rank_range<att_type>> ||         \
+      std::is_same_v<filter_type, wowlib::wow_multi_range<att_type>> ||        \
       std::is_same_v<filter_type, wowlib::wow_bitset<int>> ||                  \
       std::is_same_v<filter_type, wowlib::wow_bitset<label_t>>)
 
+// how the loading constructor brings the element region into memory
+struct LoadOptions
+{
+  bool use_mmap_{false};         // map the element region from the file instead of reading it into anonymous memory
+  bool read_only_{true};         // mmap only: shared read-only mapping, inserts are rejected; false: MAP_PRIVATE
+  bool hugepage_{false};         // mmap only: MADV_HUGEPAGE hint
+  bool willneed_{false};         // mmap only: MADV_WILLNEED hint to prefetch the whole file
+  bool freeze_{false};           // load straight into the frozen (read only, static order table) state, see freeze()
+  bool verify_checksums_{true};  // check the CRC-32C of the sections read into memory (all of them without mmap)
+  bool verify_mapped_{false};    // mmap only: also check the mapped sections, which reads the whole file at load
+};
+
+// how the parts of an element are stored
+enum class ElementLayout : uint32_t
+{
+  // one slot per element holding label, attribute, vector and link lists, an expansion fetches all of them together
+  kInterleaved = 0,
+  // labels and attributes, vectors and link lists in three arrays. filter tests and list scans touch dense arrays
+  // instead of one line of a slot that may span several pages (high dimensional vectors)
+  kSplit = 1,
+};
+
 template <typename att_t = int, typename vec_t = float>
 class WoWIndex
 {
 
 public:
+  /**
+   * @param cache_edge_dists keep the distance of every edge next to the link lists while building, so reverse edge
+   *                         pruning does not recompute them. costs (wp + 1) * M floats per element, dropped by save()
+   *                         and freeze()
+   * @param layout           see ElementLayout, kept by save() and load
+   */
   WoWIndex(size_t max_elements, size_t vec_d, size_t M, size_t efc, std::string space_name, size_t o = 4,
-      size_t wp = 10, bool auto_raise_wp = true)
-      : max_elements_(max_elements), vec_d_(vec_d), wp_(wp), o_(o), M_(M), efc_(efc)
+      size_t wp = 10, bool auto_raise_wp = true, bool cache_edge_dists = false,
+      ElementLayout layout = ElementLayout::kInterleaved)
+      : max_elements_(max_elements), vec_d_(vec_d), wp_(wp), o_(o), M_(M), efc_(efc), space_name_(space_name),
+        layout_(layout)
   {
-    if (space_name == "l2") {
-      space_ = new wowlib::L2Space(vec_d_);
-    } else if (space_name == "ip") {
-      space_ = new wowlib::InnerProductSpace(vec_d_);
-    } else {
-      throw std::runtime_error("unsupported space type " + space_name + ", supported: l2, ip");
-    }
-    fstdistfunc_     = space_->get_dist_func();
-    dist_func_param_ = space_->get_dist_func_param();
+    space_ = CreateSpace(space_name, vec_d_);
+    fstdistfunc_      = space_->get_dist_func();
+    dist_func_param_  = space_->get_dist_func_param();
+    qdistfunc_        = fstdistfunc_;
+    qdist_func_param_ = dist_func_param_;
     window_size_.emplace_back(2);
     while (window_size_.back() < max_elements_) {
       window_size_.emplace_back(o_ * window_size_.back());
@@ -60,13 +105,20 @@ public:
     offset_att_       = offset_label_ + sizeof(label_t);
     offset_vec_       = offset_att_ + sizeof(att_t);
     offset_linklists_ = offset_vec_ + sizeof(vec_t) * vec_d_;
-    linklistsmemory_  = (char *)glass::alloc2M(sizelinklistsmem_);
-    if (linklistsmemory_ == nullptr) {
-      throw std::runtime_error("Not enough memory: WoWIndex failed to allocate linklist");
+    slot_wp_          = wp_;
+    InitElementStorage(max_elements_);
+    GrowElementStorage(max_elements_);
+    if (cache_edge_dists) {
+      edge_dists_.Init((wp_ + 1) * M_ * sizeof(dist_t), max_elements_);
+      edge_dists_.Grow(max_elements_);
     }
     order_table_    = new WBTreeOrderTable<att_t>(max_elements_);
     linklist_locks_ = std::vector<std::mutex>(max_elements_);
+    deleted_        = std::vector<std::atomic<bool>>(max_elements_);
+    label_index_.Reset(max_elements_);
     visited_pool_.Init(max_elements_);
+    ResetHubs();
+    default_plan_costs_ = PlanCosts::ForDimension(vec_d_);
   }
 
   WoWIndex(const WoWIndex &)            = delete;
@@ -75,297 +127,2135 @@ public:
   WoWIndex &operator=(WoWIndex &&)      = delete;
   WoWIndex()                            = delete;
 
+  /**
+   * @brief write the index in the sectioned format
+   *
+   * a header (magic, version, type tags, parameters) is followed by 64 byte aligned sections and a section table with
+   * the CRC-32C of each: element slots, order table, label index and, if quantized, the quantizer and the full
+   * precision vectors, and the neighbor keys if enabled. only the curvec_num_ used elements are written, the capacity
+   * comes back on load.
+   */
   void save(const std::string &location)
   {
     std::ofstream ofs(location, std::ios::binary);
     if (!ofs.is_open()) {
       throw std::runtime_error("Failed to open index file for writing: " + location);
     }
+    // layers added by resizeIndex are merged back into the slots, so the file always has all wp_ + 1 layers inline
+    size_t file_sizelinks = sizelinks_per_element_ + (wp_ - slot_wp_) * (M_ + 1) * sizeof(tableint);
+    size_t n              = curvec_num_;
+    WriteBinaryPOD(ofs, kIndexMagic);
+    WriteBinaryPOD(ofs, kIndexFormatVersion);
+    WriteBinaryPOD(ofs, TypeTag<label_t>());
+    WriteBinaryPOD(ofs, TypeTag<att_t>());
+    WriteBinaryPOD(ofs, TypeTag<vec_t>());
     WriteBinaryPOD(ofs, max_elements_);
     WriteBinaryPOD(ofs, vec_d_);
     WriteBinaryPOD(ofs, wp_);
     WriteBinaryPOD(ofs, o_);
     WriteBinaryPOD(ofs, M_);
     WriteBinaryPOD(ofs, efc_);
-    WriteBinaryPOD(ofs, curvec_num_);
-    WriteBinaryPOD(ofs, cur_max_layer_);
-    WriteBinaryPOD(ofs, sizelinks_per_element_);
-    WriteBinaryPOD(ofs, sizelinklistsmem_);
+    WriteBinaryPOD(ofs, n);
+    WriteBinaryPOD(ofs, cur_max_layer_.load());
+    WriteBinaryPOD(ofs, file_sizelinks);
     WriteBinaryPOD(ofs, offset_label_);
     WriteBinaryPOD(ofs, offset_att_);
     WriteBinaryPOD(ofs, offset_vec_);
     WriteBinaryPOD(ofs, offset_linklists_);
+    // section table offset and count, patched once the sections are written
+    size_t table_pos = ofs.tellp();
+    WriteBinaryPOD(ofs, uint64_t(0));
+    WriteBinaryPOD(ofs, uint64_t(0));
 
-    ofs.write(linklistsmemory_, sizelinklistsmem_);
+    SectionWriter writer(ofs);
+    if (!compact_offsets_.empty()) {
+      elements_.Write(writer.Begin(kSectionKeys), n);
+      writer.End();
+      vecs_.Write(writer.Begin(kSectionVectors), n);
+      writer.End();
+      auto &links = writer.Begin(kSectionCompactLinks);
+      links.write((const char *)compact_offsets_.data(), (n + 1) * sizeof(uint64_t));
+      links.write((const char *)compact_edges_.data(), compact_offsets_[n] * sizeof(CompactEdge));
+      writer.End();
+      if (!compact_keys_.empty()) {
+        auto &keys = writer.Begin(kSectionCompactKeys);
+        keys.write((const char *)compact_keys_.data(), compact_keys_.size() * sizeof(att_t));
+        writer.End();
+      }
+    } else if (layout_ == ElementLayout::kInterleaved) {
+      WriteWithUpperLinks(writer.Begin(kSectionElements), elements_, offset_linklists_, n);
+      writer.End();
+    } else {
+      elements_.Write(writer.Begin(kSectionKeys), n);
+      writer.End();
+      vecs_.Write(writer.Begin(kSectionVectors), n);
+      writer.End();
+      WriteWithUpperLinks(writer.Begin(kSectionLinks), links_, 0, n);
+      writer.End();
+    }
+    order_table_->Serialize(writer.Begin(kSectionOrderTable));
+    writer.End();
+    label_index_.Serialize(writer.Begin(kSectionLabelIndex));
+    writer.End();
+    if (quantizer_ != nullptr) {
+      auto &quantizer = writer.Begin(kSectionQuantizer);
+      auto  name      = quantizer_->GetName();
+      WriteBinaryPOD(quantizer, name.size());
+      quantizer.write(name.data(), name.size());
+      quantizer_->Serialize(quantizer);
+      writer.End();
+      full_vecs_.Write(writer.Begin(kSectionFullVecs), n);
+      writer.End();
+    }
+    if (!link_keys_.Empty()) {
+      link_keys_.Write(writer.Begin(kSectionLinkKeys), n);
+      writer.End();
+    }
+    auto &hubs = writer.Begin(kSectionHubs);
+    std::vector<double> vec_sum;
+    SumVectors(vec_sum);
+    WriteBinaryPOD(hubs, vec_count_.load());
+    hubs.write((const char *)vec_sum.data(), vec_d_ * sizeof(double));
+    for (auto &hub : hubs_) {
+      WriteBinaryPOD(hubs, hub.load(std::memory_order_relaxed));
+    }
+    writer.End();
+    uint64_t table_offset = writer.WriteTable();
+    ofs.seekp(table_pos);
+    WriteBinaryPOD(ofs, table_offset);
+    WriteBinaryPOD(ofs, writer.Count());
     ofs.close();
+    if (!ofs) {
+      throw std::runtime_error("Failed to write index file: " + location);
+    }
   }
 
-  WoWIndex(const std::string &location, std::string space_name)
+  /**
+   * @brief load an index written by save(), files of the earlier unsectioned format are still read
+   */
+  WoWIndex(const std::string &location, std::string space_name, const LoadOptions &options = {})
   {
     std::ifstream ifs(location, std::ios::binary);
     if (!ifs.is_open()) {
       throw std::runtime_error("Failed to open index file: " + location);
     }
-    ReadBinaryPOD(ifs, max_elements_);
-    ReadBinaryPOD(ifs, vec_d_);
-    ReadBinaryPOD(ifs, wp_);
-    ReadBinaryPOD(ifs, o_);
-    ReadBinaryPOD(ifs, M_);
-    ReadBinaryPOD(ifs, efc_);
-    ReadBinaryPOD(ifs, curvec_num_);
-    ReadBinaryPOD(ifs, cur_max_layer_);
-    ReadBinaryPOD(ifs, sizelinks_per_element_);
-    ReadBinaryPOD(ifs, sizelinklistsmem_);
-    ReadBinaryPOD(ifs, offset_label_);
-    ReadBinaryPOD(ifs, offset_att_);
-    ReadBinaryPOD(ifs, offset_vec_);
-    ReadBinaryPOD(ifs, offset_linklists_);
-
-    if (sizelinks_per_element_ !=
-        sizeof(label_t) + sizeof(att_t) + sizeof(vec_t) * vec_d_ + sizeof(tableint) * (M_ + 1) * (wp_ + 1)) {
-      throw std::runtime_error("possible index file corruption, sizelinks_per_element_ is not equal to expected size");
+    // the destructor does not run when loading throws, the mapping and what was allocated so far are released here
+    struct ReleaseOnThrow {
+      WoWIndex *index_;
+      ~ReleaseOnThrow()
+      {
+        if (index_ != nullptr) {
+          index_->ReleaseResources();
+        }
+      }
+    } release_on_throw{this};
+    space_name_    = space_name;
+    uint64_t magic = 0;
+    ReadBinaryPOD(ifs, magic);
+    bool label_index_loaded;
+    if (ifs && magic == kIndexMagic) {
+      label_index_loaded = LoadSections(ifs, location, options);
+    } else {
+      ifs.clear();
+      ifs.seekg(0);
+      label_index_loaded = LoadLegacy(ifs, location, options);
     }
-    linklistsmemory_ = (char *)glass::alloc2M(sizelinklistsmem_);
-    if (linklistsmemory_ == nullptr) {
-      throw std::runtime_error("Failed to allocate memory for linklistsmemory_");
+    ifs.close();
+    size_t code_size = offset_linklists_ - offset_vec_;
+    if (code_size != (quantizer_ != nullptr ? quantizer_->GetCodeSize() : sizeof(vec_t) * vec_d_)) {
+      throw std::runtime_error("possible index file corruption, vector size does not match the quantizer");
     }
-    ifs.read(linklistsmemory_, sizelinklistsmem_);
-    order_table_ = new WBTreeOrderTable<att_t>(max_elements_);
-    for (tableint i = 0; i < max_elements_; ++i) {
-      auto att_mem = GetAttByInternalID(i);
-      order_table_->InsertAttInid({*att_mem, *GetLabelByInternalID(i)}, i);
+    if (!label_index_loaded) {
+      // files written before the label index was persisted
+      RebuildLabelIndex();
+    }
+    if (dynamic_cast<StaticOrderTable<att_t> *>(order_table_) != nullptr) {
+      BuildOrderRanks();
     }
-    ifs.close();
     linklist_locks_ = std::vector<std::mutex>(max_elements_);
     visited_pool_.Init(max_elements_);
     visited_pool_.Return(visited_pool_.Get());
 
-    if (space_name == "l2") {
-      space_ = new wowlib::L2Space(vec_d_);
-    } else if (space_name == "ip") {
-      space_ = new wowlib::InnerProductSpace(vec_d_);
+    space_ = CreateSpace(space_name, vec_d_);
+    fstdistfunc_      = space_->get_dist_func();
+    dist_func_param_  = space_->get_dist_func_param();
+    qdistfunc_        = quantizer_ != nullptr ? quantizer_->GetQueryDistFunc() : fstdistfunc_;
+    qdist_func_param_ = quantizer_ != nullptr ? quantizer_->GetQueryDistFuncParam() : dist_func_param_;
+    if (vec_sums_.empty()) {
+      RebuildHubs();
     } else {
-      throw std::runtime_error("unsupported space type " + space_name + ", supported: l2, ip");
+      UpdateMean();
     }
-    fstdistfunc_     = space_->get_dist_func();
-    dist_func_param_ = space_->get_dist_func_param();
+    default_plan_costs_ = PlanCosts::ForDimension(vec_d_);
 
     window_size_.emplace_back(2);
     while (window_size_.size() < wp_ + 1) {
       window_size_.emplace_back(o_ * window_size_.back());
     }
+    release_on_throw.index_ = nullptr;
     std::cout << "========================== index summary =========================" << std::endl;
     std::cout << "max_elements_: " << max_elements_ << " vec_d_: " << vec_d_ << " wp_: " << wp_ << " o_: " << o_
               << " M_: " << M_ << " efc_: " << efc_ << std::endl;
     std::cout << "curvec_num_: " << curvec_num_ << " cur_max_layer_: " << cur_max_layer_ << std::endl;
-    // calculate average out degree for each layer
-    for (size_t layer = 0; layer <= cur_max_layer_; ++layer) {
+    // calculate average out degree for each layer, skipped for mmap as it would fault in every link list and for an
+    // empty index
+    for (size_t layer = 0; layer <= cur_max_layer_ && mmap_base_ == nullptr && curvec_num_ > 0; ++layer) {
       int M = 0;
       for (size_t i = 0; i < curvec_num_; ++i) {
+        if (!compact_offsets_.empty()) {
+          for (uint64_t e = compact_offsets_[i]; e < compact_offsets_[i + 1]; ++e) {
+            M += (compact_edges_[e].layers_ >> layer) & 1;
+          }
+          continue;
+        }
         auto ll = GetLinkListByInternalID(i, layer);
         M += ll[M_];
       }
-      std::cout << "Layer: " << layer << ", average M: " << M / curvec_num_ << std::endl;
+      std::cout << "Layer: " << layer << ", average M: " << M / curvec_num_ << std::endl;
+    }
+    std::cout << "===================================================================" << std::endl;
+  }
+
+  ~WoWIndex() { ReleaseResources(); }
+
+  // float input for a reduced precision vec_t (fp16_t, bf16_t), converted before insertion
+  template <typename T = vec_t, std::enable_if_t<!std::is_same_v<T, float>, int> = 0>
+  void insert(const label_t label, const float *v, const att_t &attribute, bool replace_deleted = false)
+  {
+    std::vector<vec_t> converted(v, v + vec_d_);
+    insert(label, converted.data(), attribute, replace_deleted);
+  }
+
+  /**
+   * @brief link a new element, safe to run concurrently with other inserts and searches
+   *
+   * with replace_deleted a deleted slot is reused if there is one: its label, attribute, vector and lists are written
+   * in place, which searches read without locks. reusing inserts must not overlap searches.
+   */
+  void insert(const label_t label, const vec_t *v, const att_t &attribute, bool replace_deleted = false)
+  {
+    if (read_only_) {
+      throw std::runtime_error("index is read only (frozen or mapped read only), inserts are not allowed");
+    }
+    if (contains(label)) {
+      throw std::runtime_error("label " + std::to_string(label) + " already exists");
+    }
+    tableint cur_num;
+    bool     reuse = replace_deleted && ClaimDeletedID(cur_num);
+    if (!reuse) {
+      cur_num = ClaimInternalID();
+    }
+    // the label index entry is the claim on the label, of two concurrent inserts that both passed contains() only one
+    // gets it, the other hands its id back before touching the graph
+    memcpy(GetLabelByInternalID(cur_num), &label, sizeof(label_t));
+    if (!label_index_.Insert(label, cur_num, LabelGetter())) {
+      ReleaseID(cur_num, reuse);
+      throw std::runtime_error("label " + std::to_string(label) + " already exists");
+    }
+    if (!reuse && cur_num == 0) {
+      auto att_mem = GetAttByInternalID(cur_num);
+      memcpy(att_mem, &attribute, sizeof(att_t));
+      SetVecByInternalID(cur_num, v);
+      {
+        std::unique_lock<std::mutex> list_lock(linklist_locks_[cur_num]);
+        for (layer_t layer = 0; layer <= (layer_t)wp_; ++layer) {
+          StoreListSize(GetLinkListByInternalID(cur_num, layer), 0);
+        }
+      }
+      order_table_->InsertAttInid({*att_mem, label}, cur_num);
+      UpdateHubs(cur_num, true);
+      first_inserted_.store(true, std::memory_order_release);
+      return;
+    }
+    // every other insert needs the first element as entry point
+    while (!first_inserted_.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+    // the layer count only depends on the number of elements, so it follows from the id. layers above the current
+    // top are materialized lazily (see GetLinkListResolved) instead of copying every list when a layer is added
+    int    max_level_copy = reuse ? LayerForCount(curvec_num_) : LayerForCount(cur_num + 1);
+    size_t prev_max_layer = cur_max_layer_.load();
+    while (prev_max_layer < (size_t)max_level_copy &&
+           !cur_max_layer_.compare_exchange_weak(prev_max_layer, (size_t)max_level_copy)) {
+    }
+    if (prev_max_layer < (size_t)max_level_copy) {
+      std::cout << "raise layer from " << prev_max_layer << " to " << max_level_copy << std::endl;
+    }
+    if (reuse) {
+      // every element drops its edges to the slot before it is linked again as a new element
+      RepairNeighbors(cur_num, false);
+      RemoveInEdges(cur_num);
+      ClearLinkLists(cur_num);
+    }
+    auto tmp_linklist = SelectNeighbors(cur_num, v, attribute, label, max_level_copy, {});
+
+    // connect
+    auto att_mem = GetAttByInternalID(cur_num);
+    memcpy(att_mem, &attribute, sizeof(att_t));
+    SetVecByInternalID(cur_num, v);
+    LinkElement(cur_num, tmp_linklist);
+    order_table_->InsertAttInid({*att_mem, label}, cur_num);
+    if (reuse) {
+      deleted_[cur_num].store(false, std::memory_order_release);
+      num_deleted_--;
+    }
+    UpdateHubs(cur_num, true);
+  }
+
+  /**
+   * @brief tombstone the element with the given label
+   *
+   * its key leaves the order table and searches no longer return it, but it stays in the graph for routing until
+   * an insert with replace_deleted reuses the slot. the first delete starts tracking in-edges (see TrackInEdges).
+   */
+  void markDeleted(label_t label)
+  {
+    if (read_only_) {
+      throw std::runtime_error("index is read only (frozen or mapped read only), deletes are not allowed");
+    }
+    TrackInEdges();
+    std::lock_guard<std::mutex> lock(deleted_lock_);
+    tableint                    id = FindInternalID(label);
+    deleted_[id].store(true, std::memory_order_release);
+    num_deleted_++;
+    order_table_->RemoveAttInid({*GetAttByInternalID(id), *GetLabelByInternalID(id)}, id);
+    label_index_.Erase(label, LabelGetter());
+    free_ids_.emplace_back(id);
+    UpdateHubs(id, false);
+  }
+
+  /**
+   * @brief change the attribute of label and move it to its new windows
+   *
+   * the order table key is re-inserted and the neighbors are selected again on every layer, seeded with the old ones
+   * so layers whose window still holds them skip the graph search. old neighbors whose window no longer holds the
+   * element drop their edge to it. the vector is neither copied nor re-encoded. must not run concurrently with
+   * another update or delete of the same label.
+   */
+  void updateAttribute(label_t label, const att_t &new_att)
+  {
+    if (read_only_) {
+      throw std::runtime_error("index is read only (frozen or mapped read only), updates are not allowed");
+    }
+    tableint id  = FindInternalID(label);
+    auto     att = GetAttByInternalID(id);
+    if (*att == new_att) {
+      return;
+    }
+    order_table_->RemoveAttInid({*att, label}, id);
+    std::vector<dist_id_pair> seeds;
+    {
+      std::unique_lock<std::mutex> lock_cur(linklist_locks_[id]);
+      for (layer_t layer = 0; layer <= (layer_t)wp_; ++layer) {
+        auto ll = GetLinkListByInternalID(id, layer);
+        for (tableint i = 0; i < ll[M_]; ++i) {
+          seeds.emplace_back(!edge_dists_.Empty() ? GetEdgeDistsByInternalID(id, layer)[i] : 0, ll[i]);
+        }
+      }
+    }
+    std::sort(seeds.begin(), seeds.end(), [](const dist_id_pair &a, const dist_id_pair &b) { return a.id_ < b.id_; });
+    seeds.erase(std::unique(seeds.begin(), seeds.end(),
+                    [](const dist_id_pair &a, const dist_id_pair &b) { return a.id_ == b.id_; }),
+        seeds.end());
+    seeds.erase(std::remove_if(seeds.begin(), seeds.end(), [this](const dist_id_pair &c) { return IsDeleted(c.id_); }),
+        seeds.end());
+    auto v = GetVecByInternalID(id);
+    if (edge_dists_.Empty()) {
+      for (auto &c : seeds) {
+        c.dist_ = fstdistfunc_(v, GetVecByInternalID(c.id_), dist_func_param_);
+      }
+      metric_dist_comps_ += seeds.size();
+    }
+
+    memcpy(att, &new_att, sizeof(att_t));
+    RepairNeighbors(id, true);
+    auto tmp_linklist = SelectNeighbors(id, v, new_att, label, (layer_t)cur_max_layer_, std::move(seeds));
+    ClearLinkLists(id);
+    LinkElement(id, tmp_linklist);
+    order_table_->InsertAttInid({*att, label}, id);
+  }
+
+  auto contains(label_t label) -> bool { return label_index_.Find(label, LabelGetter()) != LabelIndex::kNotFound; }
+
+  // full precision vector of label, vec_d values are copied into OUT_vec. throws if label is not present
+  void getVector(label_t label, vec_t *OUT_vec)
+  {
+    memcpy(OUT_vec, GetVecByInternalID(FindInternalID(label)), sizeof(vec_t) * vec_d_);
+  }
+
+  auto getVector(label_t label) -> std::vector<vec_t>
+  {
+    std::vector<vec_t> vec(vec_d_);
+    getVector(label, vec.data());
+    return vec;
+  }
+
+  auto getAttribute(label_t label) -> att_t { return *GetAttByInternalID(FindInternalID(label)); }
+
+  /**
+   * @brief change the capacity to new_max elements without rebuilding
+   *
+   * elements stay where they are, only new storage segments are appended. if the windows no longer cover new_max
+   * elements and auto_raise_wp is set, layers are added on top, their lists start empty and resolve to the layer below
+   * (see ResolveLayer). shrinking below the current element count throws. must not run concurrently with inserts or
+   * searches.
+   */
+  void resizeIndex(size_t new_max, bool auto_raise_wp = true)
+  {
+    if (read_only_) {
+      throw std::runtime_error("index is read only (frozen or mapped read only), cannot resize");
+    }
+    if (new_max < curvec_num_) {
+      throw std::runtime_error("cannot resize to " + std::to_string(new_max) + ", the index holds " +
+                               std::to_string(curvec_num_) + " elements");
+    }
+    size_t new_wp = wp_;
+    while (auto_raise_wp && window_size_[new_wp] < new_max) {
+      ++new_wp;
+      if (window_size_.size() < new_wp + 1) {
+        window_size_.emplace_back(o_ * window_size_.back());
+      }
+    }
+    // a mapped element region only grows through copies of its partial last segment, the rest stays mapped
+    GrowElementStorage(new_max);
+    if (quantizer_ != nullptr) {
+      full_vecs_.Grow(new_max);
+    }
+    for (auto &upper : upper_links_) {
+      upper->Grow(new_max);
+    }
+    for (size_t layer = wp_ + 1; layer <= new_wp; ++layer) {
+      upper_links_.emplace_back(std::make_unique<SegmentedStorage>());
+      upper_links_.back()->Init((M_ + 1) * sizeof(tableint), new_max);
+      upper_links_.back()->Grow(new_max);
+    }
+    RelayoutPerLayer(edge_dists_, M_ * sizeof(dist_t), new_wp, new_max);
+    RelayoutPerLayer(link_keys_, M_ * sizeof(att_t), new_wp, new_max);
+    std::vector<std::atomic<bool>> new_deleted(new_max);
+    for (tableint i = 0; i < curvec_num_; ++i) {
+      new_deleted[i].store(IsDeleted(i), std::memory_order_relaxed);
+    }
+    deleted_.swap(new_deleted);
+    if (track_in_edges_) {
+      in_edges_.resize(new_max);
+    }
+    linklist_locks_   = std::vector<std::mutex>(new_max);
+    max_elements_     = new_max;
+    wp_               = new_wp;
+    sizelinklistsmem_ = max_elements_ * sizelinks_per_element_;
+    // the order table is sized by max_elements_ and the copied segment may have moved attributes it references
+    RebindOrderTable();
+    RebuildLabelIndex();
+    visited_pool_.Reset(max_elements_);
+  }
+
+  /**
+   * @brief make the index read only and swap the order table for a lock-free StaticOrderTable
+   *
+   * with compact_links the per layer lists are replaced by one list of distinct neighbors per element, each tagged with
+   * the layers it is in (see CompactLinks), so a neighbor repeated on several layers is stored and scanned once. must
+   * not run concurrently with inserts or searches. later inserts throw.
+   */
+  void freeze(bool compact_links = false)
+  {
+    if (dynamic_cast<StaticOrderTable<att_t> *>(order_table_) == nullptr) {
+      std::vector<tableint> ordered_ids;
+      order_table_->GetOrderedIds(ordered_ids);
+      auto frozen = new StaticOrderTable<att_t>(
+          max_elements_,
+          ordered_ids,
+          [this](tableint id) -> const att_t & { return *GetAttByInternalID(id); },
+          [this](tableint id) -> label_t { return *GetLabelByInternalID(id); });
+      delete order_table_;
+      order_table_ = frozen;
+      edge_dists_.Clear();
+    }
+    read_only_ = true;
+    // no slot is reused any more
+    track_in_edges_ = false;
+    std::vector<std::vector<tableint>>().swap(in_edges_);
+    if (compact_links && compact_offsets_.empty()) {
+      CompactLinks();
+    }
+    BuildOrderRanks();
+  }
+
+  auto IsCompact() const -> bool { return !compact_offsets_.empty(); }
+
+  /**
+   * @brief range searches whose range holds more than threshold elements are never answered by an exact scan
+   *
+   * below it the planner decides (see calibratePlanner), the results of a scan are exact. 0 only scans empty ranges.
+   */
+  void setExactScanThreshold(size_t threshold) { exact_scan_threshold_ = threshold; }
+
+  auto getExactScanThreshold() const -> size_t { return exact_scan_threshold_; }
+
+  // replaces the planner that picks how range searches are answered, the index takes ownership
+  void setQueryPlanner(std::unique_ptr<QueryPlanner> planner) { planner_ = std::move(planner); }
+
+  /**
+   * @brief measure the costs the planner compares by timing every plan, elements of the index serve as queries
+   *
+   * the windowed search is timed on a range of half the index, the scan on kCalibrateScanSize elements. costs depend
+   * on the machine, the dimension and the quantizer, so they are not saved with the index (see setPlanCosts). searches
+   * never run it, until it or setPlanCosts is called the planner uses PlanCosts::ForDimension.
+   */
+  void calibratePlanner(size_t queries = 32, size_t efs = 100)
+  {
+    std::vector<tableint> ordered;
+    order_table_->GetOrderedIds(ordered);
+    size_t live = ordered.size();
+    if (live == 0 || queries == 0) {
+      throw std::runtime_error("cannot calibrate the planner without elements and queries");
+    }
+    auto key = [&](size_t rank) -> const att_t & { return *GetAttByInternalID(ordered[std::min(rank, live - 1)]); };
+    // every query gets its own range, a range shared by all of them would stay in the cache
+    auto range = [&](size_t i, size_t n) -> wow_range<att_t> {
+      size_t first = i * (live - std::min(n, live)) / queries;
+      return {key(first), key(first + n - 1)};
+    };
+    // a context of its own, the last plan of the calling thread (getLastPlan) is left alone
+    auto   calibrate_ctx = CreateSearchContext(efs);
+    auto  &ctx           = *calibrate_ctx;
+    size_t units         = 0;
+    auto   time_ns = [&](size_t n, SearchPlan plan) -> double {
+      units      = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < queries; ++i) {
+        auto query = GetVecByInternalID(ordered[(i * live / queries + live / 2) % live]);
+        if (plan == SearchPlan::kTopLayer) {
+          SearchKNNInto(query, efs, kCalibrateK, wow_unfiltered{}, ctx, plan);
+          units += efs;
+        } else {
+          auto filter = range(i, n);
+          SearchKNNInto(query, efs, kCalibrateK, filter, ctx, plan);
+          units += plan == SearchPlan::kExactScan ? ctx.scan_ids_.size() : std::min(efs, n);
+        }
+      }
+      return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+             std::max<size_t>(units, 1);
+    };
+    PlanCosts costs;
+    costs.scan_ns_   = time_ns(kCalibrateScanSize, SearchPlan::kExactScan);
+    costs.window_ns_ = time_ns(live / 2, SearchPlan::kWindowGraph);
+    costs.top_ns_    = time_ns(0, SearchPlan::kTopLayer);
+    setPlanCosts(costs);
+  }
+
+  auto getPlanCosts() const -> const PlanCosts &
+  {
+    return plan_costs_set_.load(std::memory_order_acquire) ? plan_costs_ : default_plan_costs_;
+  }
+
+  // costs of an earlier calibratePlanner on the same machine, e.g. after loading the index again. must not run
+  // concurrently with searches once the costs are set
+  void setPlanCosts(const PlanCosts &costs)
+  {
+    plan_costs_ = costs;
+    plan_costs_set_.store(true, std::memory_order_release);
+  }
+
+  // how the last search of the calling thread was answered, a caller-owned context keeps it in ctx.plan_
+  auto getLastPlan() -> SearchPlan { return GetThreadSearchContext().plan_; }
+
+  /**
+   * @brief keep the attribute of every neighbor next to the link lists, (wp + 1) * M attributes per element
+   *
+   * range and set filtered searches then reject the neighbors outside the filter from the keys, without touching
+   * their slots. inserts, updates and deletes keep the keys current and save() writes them. a key can still lag an
+   * edge into an updated or reused slot from an element that was not its neighbor, so searches check the attribute of
+   * every neighbor that passes its key: a stale key may hide an edge but never admits an element outside the filter.
+   * must not run concurrently with inserts or searches.
+   */
+  void enableNeighborKeys()
+  {
+    if (!compact_offsets_.empty()) {
+      FillCompactKeys();
+      return;
+    }
+    if (!link_keys_.Empty()) {
+      return;
+    }
+    link_keys_.Init((wp_ + 1) * M_ * sizeof(att_t), max_elements_);
+    link_keys_.Grow(read_only_ ? curvec_num_.load() : max_elements_);
+    for (tableint i = 0; i < curvec_num_; ++i) {
+      for (layer_t layer = 0; layer <= (layer_t)wp_; ++layer) {
+        RefreshLinkKeys(i, layer);
+      }
+    }
+  }
+
+  /**
+   * @brief compress the vectors stored in the element slots with a quantizer ("sq8", "pq<m>", see CreateQuantizer)
+   * trained on the current elements
+   *
+   * graph traversal then reads the codes. the full precision vectors move to a separate array, which is only read to
+   * rerank the final beam of a search and by inserts. must not run concurrently with inserts or searches.
+   */
+  void quantize(const std::string &type)
+  {
+    if (quantizer_ != nullptr) {
+      throw std::runtime_error("index is already quantized with " + quantizer_->GetName());
+    }
+    if (read_only_) {
+      throw std::runtime_error("index is read only (frozen or mapped read only), cannot quantize");
+    }
+    if (curvec_num_ == 0) {
+      throw std::runtime_error("cannot train a quantizer on an empty index");
+    }
+    auto quantizer = CreateQuantizer(type, vec_d_, space_name_);
+    // train on an evenly strided sample, enough for per-dimension statistics and codebooks
+    size_t             n_train = std::min<size_t>(curvec_num_, kQuantizerTrainSize);
+    std::vector<float> train(n_train * vec_d_);
+    for (size_t i = 0; i < n_train; ++i) {
+      auto v = GetVecByInternalID(i * curvec_num_ / n_train);
+      std::copy(v, v + vec_d_, train.begin() + i * vec_d_);
+    }
+    quantizer->Train(train.data(), n_train);
+
+    size_t           vec_size      = sizeof(vec_t) * vec_d_;
+    size_t           code_size     = quantizer->GetCodeSize();
+    size_t           links_size    = sizeof(tableint) * (M_ + 1) * (slot_wp_ + 1);
+    size_t           new_sizelinks = offset_vec_ + code_size + links_size;
+    bool             interleaved   = layout_ == ElementLayout::kInterleaved;
+    // interleaved slots are rebuilt around the codes, the split layout only swaps its vector array for codes
+    SegmentedStorage new_codes;
+    SegmentedStorage new_full_vecs;
+    try {
+      new_codes.Init(interleaved ? new_sizelinks : code_size, max_elements_);
+      new_codes.Grow(max_elements_);
+      new_full_vecs.Init(vec_size, max_elements_);
+      new_full_vecs.Grow(max_elements_);
+    } catch (...) {
+      delete quantizer;
+      throw;
+    }
+    std::vector<float> buf;
+    for (tableint i = 0; i < curvec_num_; ++i) {
+      auto code = new_codes.At(i);
+      if (interleaved) {
+        memcpy(code, elements_.At(i), offset_vec_);
+        memcpy(code + offset_vec_ + code_size, elements_.At(i) + offset_linklists_, links_size);
+        code += offset_vec_;
+      }
+      quantizer->Encode(AsFloat(GetVecByInternalID(i), buf), (uint8_t *)code);
+      memcpy(new_full_vecs.At(i), GetVecByInternalID(i), vec_size);
+    }
+    (interleaved ? elements_ : vecs_).Swap(new_codes);
+    full_vecs_.Swap(new_full_vecs);
+    if (mmap_base_ != nullptr && interleaved) {
+      munmap(mmap_base_, mmap_len_);
+      mmap_base_ = nullptr;
+      mmap_len_  = 0;
+    }
+    sizelinks_per_element_ = new_sizelinks;
+    sizelinklistsmem_      = max_elements_ * new_sizelinks;
+    offset_linklists_      = offset_vec_ + code_size;
+    links_offset_          = interleaved ? offset_linklists_ : 0;
+    quantizer_             = quantizer;
+    qdistfunc_             = quantizer_->GetQueryDistFunc();
+    qdist_func_param_      = quantizer_->GetQueryDistFuncParam();
+    RebindOrderTable();
+  }
+
+  template <typename filter_t = wow_range<att_t>>
+  auto searchKNN(const vec_t *query_vec, size_t efs, size_t k, const filter_t &filter)
+      -> std::vector<std::pair<dist_t, label_t>>
+  {
+    auto &ctx = GetThreadSearchContext();
+    SearchKNNInto(query_vec, efs, k, filter, ctx);
+
+    auto                                   &result = ctx.result_;
+    std::vector<std::pair<dist_t, label_t>> final_res(result.size());
+    for (size_t i = 0; i < final_res.size(); ++i) {
+      final_res[i].first  = result[i].dist_;
+      final_res[i].second = *GetLabelByInternalID(result[i].id_);
+    }
+    return final_res;
+  }
+
+  /**
+   * @brief allocation-free search with a caller-owned context (see CreateSearchContext)
+   *
+   * writes at most k results sorted by ascending distance into OUT_labels and OUT_dists, returns the count.
+   */
+  template <typename filter_t = wow_range<att_t>>
+  auto searchKNN(SearchContext &ctx, const vec_t *query_vec, size_t efs, size_t k, const filter_t &filter,
+      label_t *OUT_labels, dist_t *OUT_dists) -> size_t
+  {
+    if (ctx.Capacity() < max_elements_) {
+      throw std::runtime_error("search context is smaller than the index, create it with CreateSearchContext()");
+    }
+    SearchKNNInto(query_vec, efs, k, filter, ctx);
+    auto &result = ctx.result_;
+    std::sort_heap(result.begin(), result.end());
+    for (size_t i = 0; i < result.size(); ++i) {
+      OUT_labels[i] = *GetLabelByInternalID(result[i].id_);
+      OUT_dists[i]  = result[i].dist_;
+    }
+    return result.size();
+  }
+
+  auto CreateSearchContext(size_t efs = 0) const -> std::unique_ptr<SearchContext>
+  {
+    auto ctx = std::make_unique<SearchContext>(max_elements_);
+    ctx->Reserve(efs);
+    return ctx;
+  }
+
+  /**
+   * @brief search nq queries in parallel, query i uses filters[i]
+   *
+   * results are written row-major into OUT_labels and OUT_dists (nq * k each), sorted by ascending distance.
+   * rows with fewer than k results are padded with label_t max and dist_t max.
+   * each thread searches with its thread-local context, so no lock is taken per query.
+   */
+  template <typename filter_t = wow_range<att_t>>
+  void searchKNNBatch(const vec_t *queries, size_t nq, size_t efs, size_t k, const filter_t *filters,
+      label_t *OUT_labels, dist_t *OUT_dists, size_t threads = 0)
+  {
+    if (threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::exception_ptr first_error = nullptr;
+#pragma omp parallel num_threads(threads)
+    {
+      auto &ctx = GetThreadSearchContext();
+      ctx.Reserve(efs);
+#pragma omp for schedule(dynamic, 4)
+      for (size_t i = 0; i < nq; ++i) {
+        auto labels_row = OUT_labels + i * k;
+        auto dists_row  = OUT_dists + i * k;
+        try {
+          SearchKNNInto(queries + i * vec_d_, efs, k, filters[i], ctx);
+        } catch (...) {
+#pragma omp critical
+          if (first_error == nullptr) {
+            first_error = std::current_exception();
+          }
+          ctx.result_.clear();
+        }
+        auto &result = ctx.result_;
+        std::sort_heap(result.begin(), result.end());
+        for (size_t j = 0; j < k; ++j) {
+          if (j < result.size()) {
+            labels_row[j] = *GetLabelByInternalID(result[j].id_);
+            dists_row[j]  = result[j].dist_;
+          } else {
+            labels_row[j] = std::numeric_limits<label_t>::max();
+            dists_row[j]  = std::numeric_limits<dist_t>::max();
+          }
+        }
+      }
+    }
+    if (first_error != nullptr) {
+      std::rethrow_exception(first_error);
+    }
+  }
+
+  inline __attribute__((always_inline)) auto GetDimension() const -> size_t { return vec_d_; }
+  inline __attribute__((always_inline)) auto GetMaxElements() const -> size_t { return max_elements_; }
+  inline __attribute__((always_inline)) auto GetCurNum() const -> size_t { return curvec_num_; }
+  inline __attribute__((always_inline)) auto GetDeletedNum() const -> size_t { return num_deleted_; }
+  inline __attribute__((always_inline)) auto GetCurMaxLayer() const -> size_t { return cur_max_layer_; }
+  inline __attribute__((always_inline)) auto GetM() const -> size_t { return M_; }
+  inline __attribute__((always_inline)) auto GetEfc() const -> size_t { return efc_; }
+  inline __attribute__((always_inline)) auto IsReadOnly() const -> bool { return read_only_; }
+  inline __attribute__((always_inline)) auto IsQuantized() const -> bool { return quantizer_ != nullptr; }
+
+private:
+  static auto CreateSpace(const std::string &space_name, size_t dim) -> SpaceInterface<dist_t> *
+  {
+    static_assert(std::is_same_v<vec_t, float> || std::is_same_v<vec_t, fp16_t> || std::is_same_v<vec_t, bf16_t>,
+        "vec_t must be float, fp16_t or bf16_t");
+    if (space_name == "l2") {
+      if constexpr (std::is_same_v<vec_t, float>) {
+        return new wowlib::L2Space(dim);
+      } else {
+        return new wowlib::L2SpaceHalf<vec_t>(dim);
+      }
+    } else if (space_name == "ip") {
+      if constexpr (std::is_same_v<vec_t, float>) {
+        return new wowlib::InnerProductSpace(dim);
+      } else {
+        return new wowlib::InnerProductSpaceHalf<vec_t>(dim);
+      }
+    }
+    throw std::runtime_error("unsupported space type " + space_name + ", supported: l2, ip");
+  }
+
+  /**
+   * @brief the context of the calling thread for this index, regrown after resizeIndex
+   *
+   * the index owns one context per thread that searched it and frees them with itself. a thread finds its own through
+   * a thread local map keyed by instance_id_, ids are never reused so an entry left by a destroyed index (one pointer)
+   * is never matched again.
+   */
+  auto GetThreadSearchContext() -> SearchContext &
+  {
+    thread_local std::unordered_map<uint64_t, std::unique_ptr<SearchContext> *> contexts;
+
+    auto &ctx = contexts[instance_id_];
+    if (ctx == nullptr) {
+      // deque elements stay where they are, other threads keep their pointers
+      std::lock_guard<std::mutex> lock(thread_contexts_lock_);
+      ctx = &thread_contexts_.emplace_back();
+    }
+    if (*ctx == nullptr || (*ctx)->Capacity() < max_elements_) {
+      *ctx = std::make_unique<SearchContext>(max_elements_);
+    }
+    return **ctx;
+  }
+
+  // always inline
+  inline __attribute__((always_inline)) auto GetLabelByInternalID(tableint internal_id) -> label_t *
+  {
+    return (label_t *)(elements_.At(internal_id) + offset_label_);
+  }
+
+  inline __attribute__((always_inline)) auto GetAttByInternalID(tableint internal_id) -> att_t *
+  {
+    return (att_t *)(elements_.At(internal_id) + offset_att_);
+  }
+
+  // full precision vector, kept outside the element slots once the index is quantized
+  inline __attribute__((always_inline)) auto GetVecByInternalID(tableint internal_id) -> vec_t *
+  {
+    if (quantizer_ != nullptr) {
+      return (vec_t *)full_vecs_.At(internal_id);
+    }
+    return (vec_t *)(vecs_store_->At(internal_id) + vecs_offset_);
+  }
+
+  // what traversal compares the query against: the quantized code, or the vector itself if not quantized
+  inline __attribute__((always_inline)) auto GetCodeByInternalID(tableint internal_id) -> char *
+  {
+    return vecs_store_->At(internal_id) + vecs_offset_;
+  }
+
+  void SetVecByInternalID(tableint internal_id, const vec_t *v)
+  {
+    memcpy(GetVecByInternalID(internal_id), v, sizeof(vec_t) * vec_d_);
+    if (quantizer_ != nullptr) {
+      std::vector<float> buf;
+      quantizer_->Encode(AsFloat(v, buf), (uint8_t *)GetCodeByInternalID(internal_id));
+    }
+  }
+
+  // quantizers work on float, widen a reduced precision vector into buf
+  auto AsFloat(const vec_t *v, std::vector<float> &buf) const -> const float *
+  {
+    if constexpr (std::is_same_v<vec_t, float>) {
+      return v;
+    } else {
+      buf.assign(v, v + vec_d_);
+      return buf.data();
+    }
+  }
+
+  // distances matching the first M_ entries of GetLinkListByInternalID, only with the edge distance cache
+  inline __attribute__((always_inline)) auto GetEdgeDistsByInternalID(tableint internal_id, layer_t layer) -> dist_t *
+  {
+    return (dist_t *)edge_dists_.At(internal_id) + layer * M_;
+  }
+
+  // attributes matching the first M_ entries of GetLinkListByInternalID, only with enableNeighborKeys
+  inline __attribute__((always_inline)) auto GetLinkKeysByInternalID(tableint internal_id, layer_t layer) -> att_t *
+  {
+    return (att_t *)link_keys_.At(internal_id) + layer * M_;
+  }
+
+  // recompute the neighbor keys of a list after it was written, the caller holds linklist_locks_[internal_id]
+  void RefreshLinkKeys(tableint internal_id, layer_t layer)
+  {
+    if (link_keys_.Empty()) {
+      return;
+    }
+    auto ll   = GetLinkListByInternalID(internal_id, layer);
+    auto keys = GetLinkKeysByInternalID(internal_id, layer);
+    for (tableint i = 0; i < ll[M_]; ++i) {
+      keys[i] = *GetAttByInternalID(ll[i]);
+    }
+  }
+
+  /**
+   * @brief the size of a list, kept in ll[M_]
+   *
+   * it is written under linklist_locks_ but read without it by searches (ResolveLayer, SearchCandidates). the entries
+   * of a list are written before its size is stored, so a reader that loads a size also sees the entries it covers.
+   */
+  inline __attribute__((always_inline)) auto LoadListSize(tableint *ll) const -> tableint
+  {
+    return std::atomic_ref<tableint>(ll[M_]).load(std::memory_order_acquire);
+  }
+
+  inline __attribute__((always_inline)) void StoreListSize(tableint *ll, tableint size) const
+  {
+    std::atomic_ref<tableint>(ll[M_]).store(size, std::memory_order_release);
+  }
+
+  inline __attribute__((always_inline)) auto GetLinkListByInternalID(tableint internal_id, layer_t layer) -> tableint *
+  {
+    // layers added by resizeIndex live outside the slot, one storage per layer
+    if (layer > (layer_t)slot_wp_) [[unlikely]] {
+      return (tableint *)upper_links_[layer - slot_wp_ - 1]->At(internal_id);
+    }
+    // store layers reversely to prefetch the next layer
+    return (tableint *)(links_store_->At(internal_id) + links_offset_ +
+                        (slot_wp_ - layer) * (M_ + 1) * sizeof(tableint));
+  }
+
+  /**
+   * @brief the layer actually holding the list of internal_id at layer
+   *
+   * layers above the top at the time an element was inserted are materialized lazily: an empty list stands for the
+   * list one layer below, which is what adding the layer used to copy into it.
+   */
+  inline __attribute__((always_inline)) auto ResolveLayer(tableint internal_id, layer_t layer) -> layer_t
+  {
+    while (layer > 0 && LoadListSize(GetLinkListByInternalID(internal_id, layer)) == 0) {
+      --layer;
+    }
+    return layer;
+  }
+
+  // bits l .. u of a layer mask
+  static inline __attribute__((always_inline)) auto LayerBits(layer_t l, layer_t u) -> uint32_t
+  {
+    return l > u ? 0 : (uint32_t)((uint64_t(2) << u) - (uint64_t(1) << l));
+  }
+
+  inline __attribute__((always_inline)) auto GetLinkListResolved(tableint internal_id, layer_t layer) -> tableint *
+  {
+    return GetLinkListByInternalID(internal_id, ResolveLayer(internal_id, layer));
+  }
+
+  // copy on first write for a lazily materialized list, the caller holds linklist_locks_[internal_id]
+  auto GetLinkListForWrite(tableint internal_id, layer_t layer) -> tableint *
+  {
+    auto ll        = GetLinkListByInternalID(internal_id, layer);
+    auto src_layer = ResolveLayer(internal_id, layer);
+    if (src_layer != layer) {
+      auto src = GetLinkListByInternalID(internal_id, src_layer);
+      memcpy(ll, src, M_ * sizeof(tableint));
+      if (!edge_dists_.Empty()) {
+        memcpy(GetEdgeDistsByInternalID(internal_id, layer), GetEdgeDistsByInternalID(internal_id, src_layer),
+            M_ * sizeof(dist_t));
+      }
+      if (!link_keys_.Empty()) {
+        memcpy(GetLinkKeysByInternalID(internal_id, layer), GetLinkKeysByInternalID(internal_id, src_layer),
+            M_ * sizeof(att_t));
+      }
+      StoreListSize(ll, src[M_]);
+    }
+    return ll;
+  }
+
+  // claim the next free slot, throws if the index or its layers are full
+  auto ClaimInternalID() -> tableint
+  {
+    size_t cur = curvec_num_.load();
+    do {
+      if (cur >= max_elements_) {
+        throw std::runtime_error(
+            "index is full, max_elements_: " + std::to_string(max_elements_) + ", grow it with resizeIndex");
+      }
+      LayerForCount(cur + 1);
+    } while (!curvec_num_.compare_exchange_weak(cur, cur + 1));
+    return cur;
+  }
+
+  // the smallest layer whose window covers count elements
+  auto LayerForCount(size_t count) const -> layer_t
+  {
+    layer_t layer = 0;
+    while (count > window_size_[layer]) {
+      if (layer == (layer_t)wp_) {
+        throw std::runtime_error("no enough space for new layer");
+      }
+      ++layer;
+    }
+    return layer;
+  }
+
+  /**
+   * @brief window constrained neighbor selection for cur_num from max_layer down to layer 0
+   *
+   * cur_allc seeds the candidates, each layer keeps the ones inside its window and only searches the graph when fewer
+   * than M_ are left.
+   */
+  auto SelectNeighbors(tableint cur_num, const vec_t *v, const att_t &attribute, label_t label, layer_t max_layer,
+      std::vector<dist_id_pair> cur_allc) -> std::vector<std::vector<dist_id_pair>>
+  {
+    std::vector<std::vector<dist_id_pair>> tmp_linklist(max_layer + 1);
+    auto                                   curc_record = visited_pool_.Get();
+    curc_record->Clear();
+    // every other element may have been deleted, the slot is then linked to nothing
+    for (layer_t layer = max_layer; layer >= 0 && order_table_->Size() > 0; --layer) {
+      size_t                half_window_size = window_size_[layer] / 2;
+      std::vector<tableint> entry_points;
+
+      auto query_rng = order_table_->GetWindowedFilterAndEntries({attribute, label}, half_window_size, entry_points);
+
+      for (auto ep_id : entry_points) {
+        auto d = fstdistfunc_(v, GetVecByInternalID(ep_id), dist_func_param_);
+        metric_dist_comps_++;
+        cur_allc.emplace_back(d, ep_id);
+      }
+      /**
+       * @brief building optimization
+       * we can simply use the following code to get the nearest candidates for all layers:
+       *
+       * auto allc = this->SearchCandidatesKNN(v, label, {s_pos, e_pos}, this->brparam_.efc_, status_, true);
+       *
+       * but the indexing time is log^2(n). The following code ensures in the worst case, the time is log^2 (n).
+       * It first check the previously retrieved candidates, if the number of candidates is larger than M, we can
+       * directly use them, otherwise, we need to search on the incomplete graph.
+       *
+       */
+      std::vector<dist_id_pair> filtered_curc;
+      for (const auto &[d, i] : cur_allc) {
+        auto i_att_label = att_label_t{*GetAttByInternalID(i), *GetLabelByInternalID(i)};
+        if (i_att_label >= query_rng.l_ && i_att_label <= query_rng.u_) {
+          filtered_curc.emplace_back(d, i);
+          curc_record->Set(i);
+        }
+      }
+      cur_allc = std::move(filtered_curc);
+      if (cur_allc.size() < M_) {
+        auto new_c = SearchCandidates<true>(cur_allc, v, query_rng, {layer, max_layer}, efc_, cur_num);
+        for (const auto &[d, i] : new_c) {
+          if (i == cur_num) {
+            throw std::runtime_error("repeated internal id");
+          }
+          if (!curc_record->Test(i)) {
+            cur_allc.emplace_back(d, i);
+          }
+        }
+      }
+      auto pruned         = PruneByHeuristic(cur_allc, M_ / 2);
+      tmp_linklist[layer] = std::move(pruned);
+    }
+    visited_pool_.Return(curc_record);
+    return tmp_linklist;
+  }
+
+  // write the (blank) lists of cur_num and add the reverse edges, pruning full neighbor lists to their window
+  void LinkElement(tableint cur_num, const std::vector<std::vector<dist_id_pair>> &tmp_linklist)
+  {
+    layer_t max_layer = (layer_t)tmp_linklist.size() - 1;
+    {
+      std::unique_lock<std::mutex> lock_cur(linklist_locks_[cur_num]);
+      for (layer_t layer = max_layer; layer >= 0; --layer) {
+        auto     ll    = GetLinkListByInternalID(cur_num, layer);
+        tableint ll_sz = (tableint)tmp_linklist[layer].size();
+        for (tableint i = 0; i < ll_sz; ++i) {
+          if (tmp_linklist[layer][i].id_ == cur_num) {
+            throw std::runtime_error("pruned[i].id_ == cur_num");
+          }
+          if (ll[i]) {
+            throw std::runtime_error("newly added point should have blank link list");
+          }
+          ll[i] = tmp_linklist[layer][i].id_;
+          if (!edge_dists_.Empty()) {
+            GetEdgeDistsByInternalID(cur_num, layer)[i] = tmp_linklist[layer][i].dist_;
+          }
+          AddInEdge(ll[i], cur_num);
+        }
+        StoreListSize(ll, ll_sz);
+        RefreshLinkKeys(cur_num, layer);
+      }
+    }
+    for (layer_t layer = max_layer; layer >= 0; --layer) {
+      // add and prune for neighbors in the same layer
+      for (const auto &[nn_d, nn_i] : tmp_linklist[layer]) {
+        std::lock_guard<std::mutex> lock_nn(this->linklist_locks_[nn_i]);
+        auto                        nn_ll    = GetLinkListForWrite(nn_i, layer);
+        auto                        nn_ll_sz = nn_ll[M_];
+        auto                        nn_dists = !edge_dists_.Empty() ? GetEdgeDistsByInternalID(nn_i, layer) : nullptr;
+        // a reused or updated element can still be in the list, only its key may have changed
+        if (std::find(nn_ll, nn_ll + nn_ll_sz, cur_num) != nn_ll + nn_ll_sz) {
+          RefreshLinkKeys(nn_i, layer);
+          continue;
+        }
+        if (nn_ll_sz < M_) {
+          nn_ll[nn_ll_sz] = cur_num;
+          if (nn_dists != nullptr) {
+            nn_dists[nn_ll_sz] = nn_d;
+          }
+          StoreListSize(nn_ll, nn_ll_sz + 1);
+          AddInEdge(cur_num, nn_i);
+        } else {
+          std::vector<dist_id_pair> nn_allc;
+          nn_allc.reserve(nn_ll_sz + 1);
+          for (tableint i = 0; i < nn_ll_sz; ++i) {
+            if (nn_dists != nullptr) {
+              nn_allc.emplace_back(nn_dists[i], nn_ll[i]);
+              continue;
+            }
+            nn_allc.emplace_back(
+                fstdistfunc_(GetVecByInternalID(nn_i), GetVecByInternalID(nn_ll[i]), dist_func_param_), nn_ll[i]);
+            metric_dist_comps_++;
+          }
+          size_t half_window_size = window_size_[layer] / 2;
+          /**********pruning 1 */
+          std::vector<att_label_t<att_t>> cand_att_label_vec;
+          for (size_t i = 0; i < nn_allc.size(); ++i) {
+            cand_att_label_vec.emplace_back(*GetAttByInternalID(nn_allc[i].id_), *GetLabelByInternalID(nn_allc[i].id_));
+          }
+          nn_allc = order_table_->GetInWindowCandidates(
+              nn_allc, cand_att_label_vec, {*GetAttByInternalID(nn_i), *GetLabelByInternalID(nn_i)}, half_window_size);
+          nn_allc.emplace_back(nn_d, cur_num);
+          /**********pruning 2 */
+          auto nn_pruned = PruneByHeuristic(nn_allc, M_);
+          for (tableint i = 0; i < nn_pruned.size(); ++i) {
+            nn_ll[i] = nn_pruned[i].id_;
+            if (nn_dists != nullptr) {
+              nn_dists[i] = nn_pruned[i].dist_;
+            }
+            if (nn_ll[i] == cur_num) {
+              AddInEdge(cur_num, nn_i);
+            }
+          }
+          StoreListSize(nn_ll, (tableint)nn_pruned.size());
+        }
+        RefreshLinkKeys(nn_i, layer);
+      }
+    }
+  }
+
+  void ClearLinkLists(tableint internal_id)
+  {
+    std::unique_lock<std::mutex> lock_cur(linklist_locks_[internal_id]);
+    for (layer_t layer = 0; layer <= (layer_t)wp_; ++layer) {
+      auto ll = GetLinkListByInternalID(internal_id, layer);
+      StoreListSize(ll, 0);
+      memset(ll, 0, M_ * sizeof(tableint));
+    }
+  }
+
+  inline __attribute__((always_inline)) auto IsDeleted(tableint internal_id) const -> bool
+  {
+    return deleted_[internal_id].load(std::memory_order_relaxed);
+  }
+
+  // pop a deleted slot for reuse, it stays marked deleted until it is linked again
+  auto ClaimDeletedID(tableint &OUT_id) -> bool
+  {
+    std::lock_guard<std::mutex> lock(deleted_lock_);
+    if (free_ids_.empty()) {
+      return false;
+    }
+    OUT_id = free_ids_.back();
+    free_ids_.pop_back();
+    return true;
+  }
+
+  /**
+   * @brief hand back the id of an insert that lost the claim on its label, before anything linked to it
+   *
+   * a fresh id cannot go back to curvec_num_, it becomes a tombstone without edges that replace_deleted can reuse.
+   * if it is the first element, the inserts waiting for it go on with an empty graph.
+   */
+  void ReleaseID(tableint id, bool reused)
+  {
+    if (!reused) {
+      ClearLinkLists(id);
+      deleted_[id].store(true, std::memory_order_release);
+      num_deleted_++;
+      if (id == 0) {
+        first_inserted_.store(true, std::memory_order_release);
+      }
+    }
+    std::lock_guard<std::mutex> lock(deleted_lock_);
+    free_ids_.emplace_back(id);
+  }
+
+  // id of the live element with the given label, throws if there is none
+  auto FindInternalID(label_t label) -> tableint
+  {
+    tableint id = label_index_.Find(label, LabelGetter());
+    if (id == LabelIndex::kNotFound) {
+      throw std::runtime_error("label " + std::to_string(label) + " not found");
+    }
+    return id;
+  }
+
+  inline __attribute__((always_inline)) auto LabelGetter()
+  {
+    return [this](tableint id) -> label_t { return *GetLabelByInternalID(id); };
+  }
+
+  // split layout: label and attribute of an element, padded so the label of every record is aligned
+  auto KeyRecordSize() const -> size_t
+  {
+    return (offset_vec_ + alignof(label_t) - 1) / alignof(label_t) * alignof(label_t);
+  }
+
+  // size the storages of layout_ from the slot description (sizelinks_per_element_ and the offsets)
+  void InitElementStorage(size_t capacity)
+  {
+    if (layout_ == ElementLayout::kInterleaved) {
+      elements_.Init(sizelinks_per_element_, capacity);
+      vecs_store_   = &elements_;
+      links_store_  = &elements_;
+      vecs_offset_  = offset_vec_;
+      links_offset_ = offset_linklists_;
+    } else {
+      elements_.Init(KeyRecordSize(), capacity);
+      vecs_.Init(offset_linklists_ - offset_vec_, capacity);
+      links_.Init(sizelinks_per_element_ - offset_linklists_, capacity);
+      vecs_store_   = &vecs_;
+      links_store_  = &links_;
+      vecs_offset_  = 0;
+      links_offset_ = 0;
+    }
+  }
+
+  void GrowElementStorage(size_t n)
+  {
+    elements_.Grow(n);
+    if (layout_ == ElementLayout::kSplit) {
+      vecs_.Grow(n);
+      links_.Grow(n);
+    }
+  }
+
+  // side arrays indexed by layer from 0 (edge distances, neighbor keys), a longer record keeps the old one in front
+  void RelayoutPerLayer(SegmentedStorage &store, size_t layer_size, size_t new_wp, size_t new_max)
+  {
+    if (store.Empty()) {
+      return;
+    }
+    SegmentedStorage relaid;
+    relaid.Init((new_wp + 1) * layer_size, new_max);
+    relaid.Grow(new_max);
+    for (tableint i = 0; i < curvec_num_; ++i) {
+      memcpy(relaid.At(i), store.At(i), store.RecordSize());
+    }
+    store.Swap(relaid);
+  }
+
+  /**
+   * @brief replace the per layer lists by layer runs: for every element, each distinct neighbor with the contiguous
+   * ranges of layers whose (resolved) list holds it
+   *
+   * runs are ordered by their top layer, so SearchCandidates meets them in the order of the layered scan. a neighbor
+   * whose layers are not contiguous gets one run per range. the elements move to the split layout without a link
+   * array. read only indexes only.
+   */
+  void CompactLinks()
+  {
+    if (cur_max_layer_ >= 32) {
+      throw std::runtime_error("compact links hold at most 32 layers, the index has " +
+                               std::to_string(cur_max_layer_ + 1));
+    }
+    size_t                   n = curvec_num_;
+    std::vector<uint64_t>    offsets(n + 1, 0);
+    std::vector<CompactEdge> edges;
+    std::vector<uint32_t>    layers_of(n, 0);  // layers of each neighbor of the current element
+    std::vector<tableint>    neighbors;
+    std::vector<CompactEdge> runs;
+    for (tableint i = 0; i < n; ++i) {
+      neighbors.clear();
+      for (layer_t layer = cur_max_layer_; layer >= 0; --layer) {
+        auto ll = GetLinkListResolved(i, layer);
+        for (tableint j = 0; j < ll[M_]; ++j) {
+          if (layers_of[ll[j]] == 0) {
+            neighbors.emplace_back(ll[j]);
+          }
+          layers_of[ll[j]] |= uint32_t(1) << layer;
+        }
+      }
+      runs.clear();
+      for (auto nn : neighbors) {
+        for (uint32_t rest = layers_of[nn]; rest != 0;) {
+          layer_t  top    = 31 - __builtin_clz(rest);
+          uint32_t gaps   = ~rest & ((uint32_t(1) << top) - 1);
+          layer_t  bottom = gaps == 0 ? 0 : 32 - __builtin_clz(gaps);
+          runs.push_back({nn, LayerBits(bottom, top)});
+          rest &= ~LayerBits(bottom, top);
+        }
+        layers_of[nn] = 0;
+      }
+      std::stable_sort(runs.begin(), runs.end(), [](const CompactEdge &a, const CompactEdge &b) {
+        return __builtin_clz(a.layers_) < __builtin_clz(b.layers_);
+      });
+      edges.insert(edges.end(), runs.begin(), runs.end());
+      offsets[i + 1] = edges.size();
+    }
+    // the scan prefetches one run ahead
+    edges.push_back({0, 0});
+    edges.shrink_to_fit();
+
+    if (layout_ == ElementLayout::kInterleaved) {
+      SegmentedStorage keys, vecs;
+      keys.Init(KeyRecordSize(), n);
+      keys.Grow(n);
+      vecs.Init(offset_linklists_ - offset_vec_, n);
+      vecs.Grow(n);
+      for (tableint i = 0; i < n; ++i) {
+        memcpy(keys.At(i), elements_.At(i), offset_vec_);
+        memcpy(vecs.At(i), elements_.At(i) + offset_vec_, offset_linklists_ - offset_vec_);
+      }
+      elements_.Swap(keys);
+      vecs_.Swap(vecs);
+      layout_ = ElementLayout::kSplit;
+    }
+    links_.Clear();
+    upper_links_.clear();
+    vecs_store_   = &vecs_;
+    links_store_  = &links_;
+    vecs_offset_  = 0;
+    links_offset_ = 0;
+    compact_offsets_.swap(offsets);
+    compact_edges_.swap(edges);
+    if (!link_keys_.Empty()) {
+      link_keys_.Clear();
+      FillCompactKeys();
+    }
+    // the attributes referenced by the order table may have moved
+    RebindOrderTable();
+  }
+
+  // rank of every element in the frozen order table, deleted elements have none
+  void BuildOrderRanks()
+  {
+    std::vector<tableint> ordered_ids;
+    order_table_->GetOrderedIds(ordered_ids);
+    order_ranks_.assign(curvec_num_, kNoRank);
+    for (size_t rank = 0; rank < ordered_ids.size(); ++rank) {
+      order_ranks_[ordered_ids[rank]] = rank;
+    }
+  }
+
+  // neighbor keys of a compacted index, one per layer run
+  void FillCompactKeys()
+  {
+    compact_keys_.resize(compact_offsets_.back());
+    for (uint64_t e = 0; e < compact_keys_.size(); ++e) {
+      compact_keys_[e] = *GetAttByInternalID(compact_edges_[e].id_);
+    }
+  }
+
+  // layer runs of a compacted index, and their keys if saved
+  void ReadCompactLinks(SectionReader &sections, const SectionEntry &section)
+  {
+    size_t n = curvec_num_;
+    compact_offsets_.resize(n + 1);
+    auto &is = sections.Open(section);
+    is.read((char *)compact_offsets_.data(), (n + 1) * sizeof(uint64_t));
+    if (!is || section.size_ != (n + 1) * sizeof(uint64_t) + compact_offsets_[n] * sizeof(CompactEdge)) {
+      throw std::runtime_error("possible index file corruption, compact links do not match the header");
+    }
+    compact_edges_.assign(compact_offsets_[n] + 1, {0, 0});
+    is.read((char *)compact_edges_.data(), compact_offsets_[n] * sizeof(CompactEdge));
+    sections.Close();
+    for (tableint i = 0; i < n; ++i) {
+      if (compact_offsets_[i] > compact_offsets_[i + 1]) {
+        throw std::runtime_error("possible index file corruption, compact link offsets are not ordered");
+      }
+    }
+    for (uint64_t e = 0; e < compact_offsets_[n]; ++e) {
+      if (compact_edges_[e].id_ >= n) {
+        throw std::runtime_error("possible index file corruption, compact link to a missing element");
+      }
+    }
+    if (auto keys = sections.Find(kSectionCompactKeys); keys != nullptr) {
+      if (keys->size_ != compact_offsets_[n] * sizeof(att_t)) {
+        throw std::runtime_error("possible index file corruption, compact keys do not match the links");
+      }
+      compact_keys_.resize(compact_offsets_[n]);
+      sections.Open(*keys).read((char *)compact_keys_.data(), keys->size_);
+      sections.Close();
+    }
+  }
+
+  // records [0, n) of store, with the layers added by resizeIndex merged in front of the lists at links_offset
+  void WriteWithUpperLinks(std::ostream &os, const SegmentedStorage &store, size_t links_offset, size_t n)
+  {
+    if (upper_links_.empty()) {
+      store.Write(os, n);
+      return;
+    }
+    size_t            upper_size = upper_links_.size() * (M_ + 1) * sizeof(tableint);
+    std::vector<char> record(store.RecordSize() + upper_size);
+    for (tableint i = 0; i < n; ++i) {
+      memcpy(record.data(), store.At(i), links_offset);
+      for (layer_t layer = wp_; layer > (layer_t)slot_wp_; --layer) {
+        memcpy(record.data() + links_offset + (wp_ - layer) * (M_ + 1) * sizeof(tableint),
+            GetLinkListByInternalID(i, layer), (M_ + 1) * sizeof(tableint));
+      }
+      memcpy(record.data() + links_offset + upper_size, store.At(i) + links_offset,
+          store.RecordSize() - links_offset);
+      os.write(record.data(), record.size());
+    }
+  }
+
+  // n records of a section into store, mapped in place when the file is mapped
+  void LoadStorageSection(SectionReader &sections, const SectionEntry *section, SegmentedStorage &store, size_t n)
+  {
+    if (section == nullptr || section->size_ != n * store.RecordSize()) {
+      throw std::runtime_error("possible index file corruption, element sections do not match the header");
+    }
+    if (mmap_base_ != nullptr) {
+      sections.Verify(*section, mmap_base_ + section->offset_);
+      store.Adopt(mmap_base_ + section->offset_, n);
+    } else {
+      store.Read(sections.Open(*section), n);
+      sections.Close();
+    }
+  }
+
+  // files written before the key records were padded store them offset_vec_ apart, they are copied record by record
+  void LoadKeySection(SectionReader &sections, const SectionEntry *section, size_t n)
+  {
+    if (section == nullptr || offset_vec_ == elements_.RecordSize() || section->size_ != n * offset_vec_) {
+      LoadStorageSection(sections, section, elements_, n);
+      return;
+    }
+    elements_.Grow(n);
+    if (mmap_base_ != nullptr) {
+      sections.Verify(*section, mmap_base_ + section->offset_);
+      for (size_t i = 0; i < n; ++i) {
+        memcpy(elements_.At(i), mmap_base_ + section->offset_ + i * offset_vec_, offset_vec_);
+      }
+    } else {
+      auto &is = sections.Open(*section);
+      for (size_t i = 0; i < n; ++i) {
+        is.read(elements_.At(i), offset_vec_);
+      }
+      sections.Close();
+    }
+  }
+
+  // parameters and element layout, the legacy format has the element region size after sizelinks_per_element_
+  void ReadHeader(std::istream &ifs, bool legacy)
+  {
+    ReadBinaryPOD(ifs, max_elements_);
+    ReadBinaryPOD(ifs, vec_d_);
+    ReadBinaryPOD(ifs, wp_);
+    ReadBinaryPOD(ifs, o_);
+    ReadBinaryPOD(ifs, M_);
+    ReadBinaryPOD(ifs, efc_);
+    size_t curvec_num, cur_max_layer;
+    ReadBinaryPOD(ifs, curvec_num);
+    ReadBinaryPOD(ifs, cur_max_layer);
+    curvec_num_     = curvec_num;
+    cur_max_layer_  = cur_max_layer;
+    first_inserted_ = curvec_num > 0;
+    ReadBinaryPOD(ifs, sizelinks_per_element_);
+    if (legacy) {
+      ReadBinaryPOD(ifs, sizelinklistsmem_);
+    }
+    ReadBinaryPOD(ifs, offset_label_);
+    ReadBinaryPOD(ifs, offset_att_);
+    ReadBinaryPOD(ifs, offset_vec_);
+    ReadBinaryPOD(ifs, offset_linklists_);
+    if (!ifs) {
+      throw std::runtime_error("possible index file corruption, failed to read the header");
+    }
+    slot_wp_          = wp_;
+    sizelinklistsmem_ = max_elements_ * sizelinks_per_element_;
+    size_t code_size  = offset_linklists_ - offset_vec_;
+    if (curvec_num_ > max_elements_ ||
+        sizelinks_per_element_ !=
+            sizeof(label_t) + sizeof(att_t) + code_size + sizeof(tableint) * (M_ + 1) * (wp_ + 1)) {
+      throw std::runtime_error("possible index file corruption, sizelinks_per_element_ is not equal to expected size");
+    }
+  }
+
+  // sectioned format written by save(), returns whether the label index was loaded
+  auto LoadSections(std::ifstream &ifs, const std::string &location, const LoadOptions &options) -> bool
+  {
+    uint32_t version, label_tag, att_tag, vec_tag;
+    ReadBinaryPOD(ifs, version);
+    ReadBinaryPOD(ifs, label_tag);
+    ReadBinaryPOD(ifs, att_tag);
+    ReadBinaryPOD(ifs, vec_tag);
+    if (version > kIndexFormatVersion) {
+      throw std::runtime_error("index file format version " + std::to_string(version) + " is newer than supported " +
+                               std::to_string(kIndexFormatVersion));
+    }
+    if (label_tag != TypeTag<label_t>() || att_tag != TypeTag<att_t>() || vec_tag != TypeTag<vec_t>()) {
+      throw std::runtime_error("index file was written with a different label, attribute or vector type");
+    }
+    ReadHeader(ifs, false);
+    uint64_t table_offset, section_count;
+    ReadBinaryPOD(ifs, table_offset);
+    ReadBinaryPOD(ifs, section_count);
+    ifs.seekg(0, std::ios::end);
+    // the mapped sections (elements, full precision vectors, neighbor keys) are only checked on request, checking
+    // them faults in every page and gives up the fast start of mmap
+    SectionReader sections(
+        ifs, ifs.tellg(), options.verify_checksums_, options.verify_checksums_ && options.verify_mapped_);
+    sections.ReadTable(table_offset, section_count);
+
+    // a frozen or read-only mapped index never grows, so only the stored elements are brought in
+    read_only_ = options.freeze_ || (options.use_mmap_ && options.read_only_);
+    layout_    = sections.Find(kSectionElements) != nullptr ? ElementLayout::kInterleaved : ElementLayout::kSplit;
+    InitElementStorage(max_elements_);
+    if (options.use_mmap_) {
+      mmap_base_ = MapFile(location, !options.read_only_, options.hugepage_, options.willneed_, mmap_len_);
+    }
+    try {
+      if (layout_ == ElementLayout::kInterleaved) {
+        LoadStorageSection(sections, sections.Find(kSectionElements), elements_, curvec_num_);
+      } else {
+        LoadKeySection(sections, sections.Find(kSectionKeys), curvec_num_);
+        LoadStorageSection(sections, sections.Find(kSectionVectors), vecs_, curvec_num_);
+        if (auto compact = sections.Find(kSectionCompactLinks); compact != nullptr) {
+          // compacted by freeze(true), there are no lists to insert into
+          ReadCompactLinks(sections, *compact);
+          read_only_ = true;
+        } else {
+          LoadStorageSection(sections, sections.Find(kSectionLinks), links_, curvec_num_);
+        }
+      }
+    } catch (...) {
+      if (mmap_base_ != nullptr) {
+        munmap(mmap_base_, mmap_len_);
+        mmap_base_ = nullptr;
+      }
+      throw;
+    }
+    if (!read_only_) {
+      GrowElementStorage(max_elements_);
+    }
+
+    deleted_ = std::vector<std::atomic<bool>>(max_elements_);
+    if (options.freeze_) {
+      order_table_ = new StaticOrderTable<att_t>(max_elements_);
+    } else {
+      order_table_ = new WBTreeOrderTable<att_t>(max_elements_);
+    }
+    auto order_table = sections.Find(kSectionOrderTable);
+    if (order_table == nullptr) {
+      throw std::runtime_error("possible index file corruption, order table section is missing");
+    }
+    order_table_->Deserialize(sections.Open(*order_table), curvec_num_,
+        [this](tableint id) -> const att_t & { return *GetAttByInternalID(id); });
+    sections.Close();
+    RestoreDeleted();
+
+    bool label_index_loaded = false;
+    if (auto label_index = sections.Find(kSectionLabelIndex); label_index != nullptr) {
+      label_index_.Deserialize(
+          sections.Open(*label_index), max_elements_, curvec_num_, LabelGetter(), !options.verify_checksums_);
+      sections.Close();
+      label_index_loaded = true;
+    }
+    if (auto quantizer = sections.Find(kSectionQuantizer); quantizer != nullptr) {
+      ReadQuantizer(sections.Open(*quantizer));
+      sections.Close();
+      auto full_vecs = sections.Find(kSectionFullVecs);
+      full_vecs_.Init(sizeof(vec_t) * vec_d_, max_elements_);
+      LoadStorageSection(sections, full_vecs, full_vecs_, curvec_num_);
+      if (mmap_base_ != nullptr && options.willneed_ == false) {
+        // only the final rerank reads them, keep them out of the readahead of the hot element region
+        auto base = mmap_base_ + full_vecs->offset_;
+        madvise(base - full_vecs->offset_ % 4096, full_vecs->size_ + full_vecs->offset_ % 4096, MADV_RANDOM);
+      }
+      if (!read_only_) {
+        full_vecs_.Grow(max_elements_);
+      }
+    }
+    if (auto link_keys = sections.Find(kSectionLinkKeys); link_keys != nullptr) {
+      link_keys_.Init((wp_ + 1) * M_ * sizeof(att_t), max_elements_);
+      LoadStorageSection(sections, link_keys, link_keys_, curvec_num_);
+      if (!read_only_) {
+        link_keys_.Grow(max_elements_);
+      }
+    }
+    // without the section the loading constructor rebuilds the hubs
+    if (auto hubs = sections.Find(kSectionHubs); hubs != nullptr) {
+      if (hubs->size_ != sizeof(size_t) + vec_d_ * sizeof(double) + kNumHubs * sizeof(tableint)) {
+        throw std::runtime_error("possible index file corruption, hub section size does not match the dimension");
+      }
+      ResetHubs();
+      auto               &is = sections.Open(*hubs);
+      size_t              vec_count;
+      std::vector<double> vec_sum(vec_d_);
+      ReadBinaryPOD(is, vec_count);
+      is.read((char *)vec_sum.data(), vec_d_ * sizeof(double));
+      vec_count_ = vec_count;
+      for (size_t i = 0; i < vec_d_; ++i) {
+        vec_sums_[i].store(vec_sum[i], std::memory_order_relaxed);
+      }
+      for (auto &hub : hubs_) {
+        tableint id;
+        ReadBinaryPOD(is, id);
+        if (id != kNoHub && id >= curvec_num_) {
+          throw std::runtime_error("possible index file corruption, hub out of range");
+        }
+        hub.store(id, std::memory_order_relaxed);
+      }
+      sections.Close();
+    }
+    return label_index_loaded;
+  }
+
+  // format before save() wrote sections: header, the whole element region, then optional trailing parts
+  auto LoadLegacy(std::ifstream &ifs, const std::string &location, const LoadOptions &options) -> bool
+  {
+    ReadHeader(ifs, true);
+    size_t header_size = ifs.tellg();
+    if (options.use_mmap_) {
+      mmap_base_         = MapFile(location, !options.read_only_, options.hugepage_, options.willneed_, mmap_len_);
+      if (mmap_len_ < header_size + sizelinklistsmem_) {
+        munmap(mmap_base_, mmap_len_);
+        mmap_base_ = nullptr;
+        throw std::runtime_error("possible index file corruption, file is shorter than the element region");
+      }
+      InitElementStorage(max_elements_);
+      elements_.Adopt(mmap_base_ + header_size, max_elements_);
+      read_only_ = options.read_only_;
+    } else {
+      InitElementStorage(max_elements_);
+      elements_.Read(ifs, max_elements_);
+    }
+    deleted_ = std::vector<std::atomic<bool>>(max_elements_);
+    if (options.freeze_) {
+      order_table_ = new StaticOrderTable<att_t>(max_elements_);
+      read_only_   = true;
+    } else {
+      order_table_ = new WBTreeOrderTable<att_t>(max_elements_);
+    }
+    ifs.seekg(header_size + sizelinklistsmem_);
+    bool label_index_loaded = false;
+    if (ifs.peek() != std::ifstream::traits_type::eof()) {
+      order_table_->Deserialize(
+          ifs, curvec_num_, [this](tableint id) -> const att_t & { return *GetAttByInternalID(id); });
+      if (!ifs) {
+        throw std::runtime_error("possible index file corruption, order table does not match the elements");
+      }
+      RestoreDeleted();
+      label_index_loaded = LoadLabelIndex(ifs);
+      if (ifs.peek() != std::ifstream::traits_type::eof()) {
+        LoadQuantizer(ifs, options);
+      }
+    } else {
+      // files written before the order table was persisted
+      if (options.freeze_) {
+        delete order_table_;
+        order_table_ = new WBTreeOrderTable<att_t>(max_elements_);
+      }
+      for (tableint i = 0; i < curvec_num_; ++i) {
+        auto att_mem = GetAttByInternalID(i);
+        order_table_->InsertAttInid({*att_mem, *GetLabelByInternalID(i)}, i);
+      }
+      if (options.freeze_) {
+        freeze();
+      }
+    }
+    return label_index_loaded;
+  }
+
+  // the label index section is tagged, files written before it was persisted go on with the quantizer or end
+  auto LoadLabelIndex(std::ifstream &ifs) -> bool
+  {
+    auto     pos = ifs.tellg();
+    uint64_t tag = 0;
+    ReadBinaryPOD(ifs, tag);
+    if (!ifs || tag != kLabelIndexTag) {
+      ifs.clear();
+      ifs.seekg(pos);
+      return false;
+    }
+    label_index_.Deserialize(ifs, max_elements_, curvec_num_, LabelGetter());
+    return true;
+  }
+
+  // ids below curvec_num_ missing from a loaded order table were deleted, the table is the only record of it
+  void RestoreDeleted()
+  {
+    std::vector<tableint> live_ids;
+    order_table_->GetOrderedIds(live_ids);
+    std::vector<bool> live(curvec_num_, false);
+    for (auto id : live_ids) {
+      if (id >= curvec_num_) {
+        throw std::runtime_error("possible index file corruption, order table does not match the elements");
+      }
+      live[id] = true;
+    }
+    for (tableint i = 0; i < curvec_num_; ++i) {
+      if (!live[i]) {
+        deleted_[i] = true;
+        free_ids_.emplace_back(i);
+      }
+    }
+    num_deleted_ = free_ids_.size();
+  }
+
+  /**
+   * @brief unlink a deleted slot or an element with a changed attribute from the stored lists that point to it
+   *
+   * every neighbor of id that links back to it rebuilds that list from its other edges and the own neighbors of id,
+   * restricted to its window and pruned as in insert. with keep_in_window, lists whose window still holds the
+   * (already updated) attribute of id are left alone. edges from elements id does not link to are left, they only
+   * route to an element with a different attribute.
+   */
+  void RepairNeighbors(tableint id, bool keep_in_window)
+  {
+    std::vector<tableint> old_ll;
+    for (layer_t layer = 0; layer <= (layer_t)cur_max_layer_; ++layer) {
+      {
+        std::lock_guard<std::mutex> lock(linklist_locks_[id]);
+        if (ResolveLayer(id, layer) != layer) {
+          continue;
+        }
+        auto ll = GetLinkListByInternalID(id, layer);
+        old_ll.assign(ll, ll + ll[M_]);
+      }
+      for (auto nn_i : old_ll) {
+        std::lock_guard<std::mutex> lock_nn(linklist_locks_[nn_i]);
+        layer_t                     nn_layer = ResolveLayer(nn_i, layer);
+        auto                        nn_ll    = GetLinkListByInternalID(nn_i, nn_layer);
+        if (std::find(nn_ll, nn_ll + nn_ll[M_], id) == nn_ll + nn_ll[M_]) {
+          continue;
+        }
+        att_label_t<att_t> nn_att_label{*GetAttByInternalID(nn_i), *GetLabelByInternalID(nn_i)};
+        if (keep_in_window) {
+          std::vector<dist_id_pair>       self{{0, id}};
+          std::vector<att_label_t<att_t>> self_att_label{{*GetAttByInternalID(id), *GetLabelByInternalID(id)}};
+          auto in_window =
+              order_table_->GetInWindowCandidates(self, self_att_label, nn_att_label, window_size_[nn_layer] / 2);
+          if (!in_window.empty()) {
+            RefreshLinkKeys(nn_i, nn_layer);
+            continue;
+          }
+        }
+        std::vector<dist_id_pair> nn_allc;
+        for (auto c : old_ll) {
+          if (c != nn_i && std::find(nn_ll, nn_ll + nn_ll[M_], c) == nn_ll + nn_ll[M_]) {
+            nn_allc.emplace_back(0, c);
+          }
+        }
+        for (tableint i = 0; i < nn_ll[M_]; ++i) {
+          if (nn_ll[i] != id) {
+            nn_allc.emplace_back(0, nn_ll[i]);
+          }
+        }
+        std::vector<att_label_t<att_t>> cand_att_label_vec;
+        for (auto &c : nn_allc) {
+          c.dist_ = fstdistfunc_(GetVecByInternalID(nn_i), GetVecByInternalID(c.id_), dist_func_param_);
+          metric_dist_comps_++;
+          cand_att_label_vec.emplace_back(*GetAttByInternalID(c.id_), *GetLabelByInternalID(c.id_));
+        }
+        nn_allc = order_table_->GetInWindowCandidates(
+            nn_allc, cand_att_label_vec, nn_att_label, window_size_[nn_layer] / 2);
+        auto nn_pruned = PruneByHeuristic(nn_allc, M_);
+        auto nn_dists  = !edge_dists_.Empty() ? GetEdgeDistsByInternalID(nn_i, nn_layer) : nullptr;
+        for (tableint i = 0; i < nn_pruned.size(); ++i) {
+          nn_ll[i] = nn_pruned[i].id_;
+          if (nn_dists != nullptr) {
+            nn_dists[i] = nn_pruned[i].dist_;
+          }
+          AddInEdge(nn_ll[i], nn_i);
+        }
+        StoreListSize(nn_ll, (tableint)nn_pruned.size());
+        RefreshLinkKeys(nn_i, nn_layer);
+      }
+    }
+  }
+
+  /**
+   * @brief start recording in-edges, in_edges_[x] then holds every element with an edge to x on some layer
+   *
+   * only reused slots need them (see RemoveInEdges), so an index is tracked from its first delete or reuse on, which
+   * takes one pass over all lists. in_edges_ is a superset: edges pruned later leave their source behind, that source
+   * is checked for nothing. it is not saved, a loaded index starts over.
+   */
+  void TrackInEdges()
+  {
+    if (track_in_edges_.load(std::memory_order_acquire)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(in_edges_init_lock_);
+    if (track_in_edges_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    in_edges_.resize(max_elements_);
+    // an edge is recorded under the lock of its source list, so a list written after the pass read it sees the flag
+    track_in_edges_.store(true, std::memory_order_release);
+    for (tableint src = 0; src < curvec_num_; ++src) {
+      std::lock_guard<std::mutex> lock_src(linklist_locks_[src]);
+      for (layer_t layer = 0; layer <= (layer_t)wp_; ++layer) {
+        auto ll = GetLinkListByInternalID(src, layer);
+        for (tableint i = 0; i < ll[M_]; ++i) {
+          AddInEdge(ll[i], src);
+        }
+      }
+    }
+  }
+
+  // record the edge src -> dst, the caller holds linklist_locks_[src]
+  void AddInEdge(tableint dst, tableint src)
+  {
+    if (!track_in_edges_.load(std::memory_order_acquire)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(in_edge_locks_[dst % kInEdgeLockStripes]);
+    auto                       &srcs = in_edges_[dst];
+    if (std::find(srcs.begin(), srcs.end(), src) == srcs.end()) {
+      srcs.emplace_back(src);
+    }
+  }
+
+  /**
+   * @brief drop the edges into a deleted slot that RepairNeighbors leaves, before the slot is reused
+   *
+   * RepairNeighbors only reaches the elements the slot links to. every other element recorded in in_edges_[id] drops
+   * the slot from its lists on all layers, so after the reuse no list holds an edge to the old element. costs one
+   * list check per layer and recorded source.
+   */
+  void RemoveInEdges(tableint id)
+  {
+    TrackInEdges();
+    std::vector<tableint> srcs;
+    {
+      std::lock_guard<std::mutex> lock(in_edge_locks_[id % kInEdgeLockStripes]);
+      srcs.swap(in_edges_[id]);
+    }
+    for (auto src : srcs) {
+      if (src == id) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(linklist_locks_[src]);
+      for (layer_t layer = 0; layer <= (layer_t)wp_; ++layer) {
+        auto     ll    = GetLinkListByInternalID(src, layer);
+        auto     dists = !edge_dists_.Empty() ? GetEdgeDistsByInternalID(src, layer) : nullptr;
+        tableint kept  = 0;
+        for (tableint i = 0; i < ll[M_]; ++i) {
+          if (ll[i] != id) {
+            if (dists != nullptr) {
+              dists[kept] = dists[i];
+            }
+            ll[kept++] = ll[i];
+          }
+        }
+        if (kept != ll[M_]) {
+          StoreListSize(ll, kept);
+          RefreshLinkKeys(src, layer);
+        }
+      }
     }
-    std::cout << "===================================================================" << std::endl;
   }
 
-  ~WoWIndex()
+  // what the destructor frees, also run when a loading constructor throws
+  void ReleaseResources()
   {
-    free(linklistsmemory_);
-    linklistsmemory_ = nullptr;
+    // adopted segments of the storages are only views into the mapping
+    if (mmap_base_ != nullptr) {
+      munmap(mmap_base_, mmap_len_);
+      mmap_base_ = nullptr;
+      mmap_len_  = 0;
+    }
+    delete quantizer_;
     delete space_;
     delete order_table_;
+    quantizer_   = nullptr;
+    space_       = nullptr;
+    order_table_ = nullptr;
   }
 
-  void insert(const label_t label, const vec_t *v, const att_t &attribute, bool replace_deleted = false)
+  // quantizer name and parameters
+  void ReadQuantizer(std::istream &is)
   {
-    int      max_level_copy = -1;
-    tableint cur_num        = -1;
-    {
-      std::unique_lock<std::mutex> lock(max_layer_lock_);
-      cur_num = curvec_num_++;
-      {
-        if (cur_num == 0) {
-          auto label_mem = GetLabelByInternalID(cur_num);
-          auto att_mem   = GetAttByInternalID(cur_num);
-          auto vec_mem   = GetVecByInternalID(cur_num);
-          memcpy(label_mem, &label, sizeof(label_t));
-          memcpy(att_mem, &attribute, sizeof(att_t));
-          memcpy(vec_mem, v, sizeof(vec_t) * vec_d_);
-          std::unique_lock<std::mutex> list_lock(linklist_locks_[cur_num]);
-          for (layer_t layer = 0; layer <= wp_; ++layer) {
-            auto ll = GetLinkListByInternalID(cur_num, layer);
-            ll[M_]  = 0;
-          }
-          order_table_->InsertAttInid({*att_mem, *label_mem}, cur_num);
-          return;
-        }
+    size_t name_len;
+    ReadBinaryPOD(is, name_len);
+    if (!is || name_len > 64) {
+      throw std::runtime_error("possible index file corruption, invalid quantizer name");
+    }
+    std::string name(name_len, '\0');
+    is.read(name.data(), name_len);
+    quantizer_ = CreateQuantizer(name, vec_d_, space_name_);
+    quantizer_->Deserialize(is);
+  }
+
+  // legacy format: quantizer, then the full precision vectors of all max_elements_ slots at the next 64 bytes
+  void LoadQuantizer(std::ifstream &ifs, const LoadOptions &options)
+  {
+    ReadQuantizer(ifs);
+    size_t pos       = ifs.tellg();
+    size_t offset    = (pos + 63) / 64 * 64;
+    size_t vecs_size = max_elements_ * sizeof(vec_t) * vec_d_;
+    if (mmap_base_ != nullptr) {
+      if (mmap_len_ < offset + vecs_size) {
+        throw std::runtime_error("possible index file corruption, file is shorter than the full precision vectors");
+      }
+      full_vecs_.Init(sizeof(vec_t) * vec_d_, max_elements_);
+      full_vecs_.Adopt(mmap_base_ + offset, max_elements_);
+      if (options.willneed_ == false) {
+        // only the final rerank reads them, keep them out of the readahead of the hot element region
+        madvise(mmap_base_ + offset - offset % 4096, vecs_size + offset % 4096, MADV_RANDOM);
       }
+    } else {
+      full_vecs_.Init(sizeof(vec_t) * vec_d_, max_elements_);
+      ifs.seekg(offset);
+      full_vecs_.Read(ifs, max_elements_);
+    }
+    if (!ifs) {
+      throw std::runtime_error("possible index file corruption, failed to read the quantizer");
+    }
+  }
 
-      if (curvec_num_ > window_size_[cur_max_layer_]) {
-        if (this->cur_max_layer_ == wp_) {
-          throw std::runtime_error("no enough space for new layer");
-        }
-        std::cout << "raise layer from " << this->cur_max_layer_ << " to " << this->cur_max_layer_ + 1 << std::endl;
-        this->cur_max_layer_++;
-        // copy
-        for (tableint lower_id = 0; lower_id < curvec_num_; ++lower_id) {
-          auto lower_link_list = GetLinkListByInternalID(lower_id, this->cur_max_layer_ - 1);
-          if (lower_link_list[M_] == 0) {
-            continue;
-          }
-          auto upper_link_list = GetLinkListByInternalID(lower_id, this->cur_max_layer_);
-          memcpy(upper_link_list, lower_link_list, (M_ + 1) * sizeof(tableint));
-        }
+  void RebuildLabelIndex()
+  {
+    label_index_.Reset(max_elements_);
+    for (tableint i = 0; i < curvec_num_; ++i) {
+      if (!IsDeleted(i)) {
+        label_index_.Insert(*GetLabelByInternalID(i), i, LabelGetter());
       }
-      max_level_copy = cur_max_layer_;
     }
-    if (max_level_copy == -1 || cur_num == -1) {
-      throw std::runtime_error("-1: initilize failed");
+  }
+
+  void ResetHubs()
+  {
+    for (auto &hub : hubs_) {
+      hub.store(kNoHub, std::memory_order_relaxed);
     }
-    std::vector<std::vector<dist_id_pair>> tmp_linklist(max_level_copy + 1);
-    std::vector<dist_id_pair>              cur_allc;
-    auto                                   curc_record = visited_pool_.Get();
-    curc_record->Clear();
-    for (layer_t layer = max_level_copy; layer >= 0; --layer) {
-      size_t                half_window_size = window_size_[layer] / 2;
-      std::vector<tableint> entry_points;
+    sum_stride_ = (vec_d_ + 7) / 8 * 8;
+    vec_sums_   = std::vector<std::atomic<double>>(kSumStripes * sum_stride_);
+    vec_count_  = 0;
+    vec_mean_.assign(vec_d_, vec_t(0.0f));
+  }
 
-      auto query_rng = order_table_->GetWindowedFilterAndEntries({attribute, label}, half_window_size, entry_points);
+  // the running sum of the live vectors, added up over the stripes
+  void SumVectors(std::vector<double> &OUT_sum) const
+  {
+    OUT_sum.assign(vec_d_, 0);
+    for (size_t s = 0; s < kSumStripes; ++s) {
+      for (size_t i = 0; i < vec_d_; ++i) {
+        OUT_sum[i] += vec_sums_[s * sum_stride_ + i].load(std::memory_order_relaxed);
+      }
+    }
+  }
 
-      for (auto ep_id : entry_points) {
-        auto d = fstdistfunc_(v, GetVecByInternalID(ep_id), dist_func_param_);
-        metric_dist_comps_++;
-        cur_allc.emplace_back(d, ep_id);
+  // with hubs_lock_ held or before the index is shared
+  void UpdateMean()
+  {
+    std::vector<double> sum;
+    SumVectors(sum);
+    size_t count = vec_count_.load(std::memory_order_relaxed);
+    for (size_t i = 0; count > 0 && i < vec_d_; ++i) {
+      vec_mean_[i] = vec_t(float(sum[i] / count));
+    }
+  }
+
+  /**
+   * @brief account for id entering (added) or leaving the index
+   *
+   * the vector goes into the sum stripe of the calling thread with relaxed atomic adds, so concurrent inserts do not
+   * wait on each other. the hubs are refreshed every kHubRefreshPeriod updates, when there are none yet or when a hub
+   * leaves, by whichever thread gets hubs_lock_ without waiting. the others move on, a deleted hub keeps serving as
+   * an entry point (tombstones still route) until the next refresh.
+   */
+  void UpdateHubs(tableint id, bool added)
+  {
+    static std::atomic<size_t> next_stripe{0};
+    thread_local size_t        stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % kSumStripes;
+    auto                       v      = GetVecByInternalID(id);
+    auto                       sums   = vec_sums_.data() + stripe * sum_stride_;
+    for (size_t i = 0; i < vec_d_; ++i) {
+      sums[i].fetch_add(added ? float(v[i]) : -float(v[i]), std::memory_order_relaxed);
+    }
+    if (added) {
+      vec_count_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      vec_count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    bool due = hub_updates_.fetch_add(1, std::memory_order_relaxed) % kHubRefreshPeriod == 0 ||
+               hubs_[0].load(std::memory_order_relaxed) == kNoHub;
+    for (auto &hub : hubs_) {
+      due |= !added && hub.load(std::memory_order_relaxed) == id;
+    }
+    if (!due) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(hubs_lock_, std::try_to_lock);
+    if (lock.owns_lock()) {
+      RefreshHubs(added ? id : kNoHub);
+    }
+  }
+
+  /**
+   * @brief move hubs_ to the live elements nearest to the current mean
+   *
+   * the held hubs, their top layer neighbors and extra are scored, a local step towards the mean that costs about
+   * kNumHubs * (M + 1) distances per refresh. called with hubs_lock_ held.
+   */
+  void RefreshHubs(tableint extra)
+  {
+    UpdateMean();
+    std::vector<dist_id_pair> cands;
+
+    auto consider = [&](tableint c) {
+      auto held = [c](const dist_id_pair &p) { return p.id_ == c; };
+      if (c != kNoHub && !IsDeleted(c) && std::none_of(cands.begin(), cands.end(), held)) {
+        cands.emplace_back(fstdistfunc_(vec_mean_.data(), GetVecByInternalID(c), dist_func_param_), c);
       }
-      /**
-       * @brief building optimization
-       * we can simply use the following code to get the nearest candidates for all layers:
-       *
-       * auto allc = this->SearchCandidatesKNN(v, label, {s_pos, e_pos}, this->brparam_.efc_, status_, true);
-       *
-       * but the indexing time is log^2(n). The following code ensures in the worst case, the time is log^2 (n).
-       * It first check the previously retrieved candidates, if the number of candidates is larger than M, we can
-       * directly use them, otherwise, we need to search on the incomplete graph.
-       *
-       */
-      std::vector<dist_id_pair> filtered_curc;
-      for (const auto &[d, i] : cur_allc) {
-        auto i_att_label = att_label_t{*GetAttByInternalID(i), *GetLabelByInternalID(i)};
-        if (i_att_label >= query_rng.l_ && i_att_label <= query_rng.u_) {
-          filtered_curc.emplace_back(d, i);
-          curc_record->Set(i);
-        }
+    };
+    for (auto &hub : hubs_) {
+      tableint h = hub.load(std::memory_order_relaxed);
+      if (h == kNoHub) {
+        continue;
       }
-      cur_allc = std::move(filtered_curc);
-      if (cur_allc.size() < M_) {
-        auto new_c = SearchCandidates<true>(cur_allc, v, query_rng, {layer, max_level_copy}, efc_, cur_num);
-        for (const auto &[d, i] : new_c) {
-          if (i == cur_num) {
-            throw std::runtime_error("repeated internal id");
-          }
-          if (!curc_record->Test(i)) {
-            cur_allc.emplace_back(d, i);
-          }
-        }
+      consider(h);
+      auto ll = GetLinkListResolved(h, static_cast<layer_t>(cur_max_layer_));
+      for (size_t j = 0, ll_sz = LoadListSize(ll); j < ll_sz; ++j) {
+        consider(ll[j]);
       }
-      auto pruned         = PruneByHeuristic(cur_allc, M_ / 2);
-      tmp_linklist[layer] = std::move(pruned);
     }
-    visited_pool_.Return(curc_record);
+    consider(extra);
+    std::sort(cands.begin(), cands.end());
+    for (size_t i = 0; i < kNumHubs; ++i) {
+      hubs_[i].store(i < cands.size() ? cands[i].id_ : kNoHub, std::memory_order_relaxed);
+    }
+  }
 
-    // connect
-    {
-      auto label_mem = GetLabelByInternalID(cur_num);
-      auto att_mem   = GetAttByInternalID(cur_num);
-      auto vec_mem   = GetVecByInternalID(cur_num);
-      memcpy(label_mem, &label, sizeof(label_t));
-      memcpy(att_mem, &attribute, sizeof(att_t));
-      memcpy(vec_mem, v, sizeof(vec_t) * vec_d_);
-      std::unique_lock<std::mutex> lock_cur(linklist_locks_[cur_num]);
-      for (layer_t layer = max_level_copy; layer >= 0; --layer) {
-        auto ll = GetLinkListByInternalID(cur_num, layer);
-        ll[M_]  = (tableint)tmp_linklist[layer].size();
-        for (tableint i = 0; i < ll[M_]; ++i) {
-          if (tmp_linklist[layer][i].id_ == cur_num) {
-            throw std::runtime_error("pruned[i].id_ == cur_num");
-          }
-          if (ll[i]) {
-            throw std::runtime_error("newly added point should have blank link list");
-          }
-          ll[i] = tmp_linklist[layer][i].id_;
+  // files written before the hubs were persisted, one pass for the mean and one for the nearest live elements
+  void RebuildHubs()
+  {
+    ResetHubs();
+    for (tableint i = 0; i < curvec_num_; ++i) {
+      if (!IsDeleted(i)) {
+        auto v = GetVecByInternalID(i);
+        for (size_t j = 0; j < vec_d_; ++j) {
+          vec_sums_[j].store(vec_sums_[j].load(std::memory_order_relaxed) + float(v[j]), std::memory_order_relaxed);
         }
+        vec_count_++;
       }
     }
-    for (layer_t layer = max_level_copy; layer >= 0; --layer) {
-      // add and prune for neighbors in the same layer
-      for (const auto &[nn_d, nn_i] : tmp_linklist[layer]) {
-        std::lock_guard<std::mutex> lock_nn(this->linklist_locks_[nn_i]);
-        auto                        nn_ll    = GetLinkListByInternalID(nn_i, layer);
-        auto                        nn_ll_sz = nn_ll[M_];
-        if (nn_ll_sz < M_) {
-          nn_ll[nn_ll_sz] = cur_num;
-          nn_ll[M_]++;
-        } else {
-          std::vector<dist_id_pair> nn_allc;
-          nn_allc.reserve(nn_ll_sz + 1);
-          for (tableint i = 0; i < nn_ll_sz; ++i) {
-            nn_allc.emplace_back(
-                fstdistfunc_(GetVecByInternalID(nn_i), GetVecByInternalID(nn_ll[i]), dist_func_param_), nn_ll[i]);
-          }
-          size_t half_window_size = window_size_[layer] / 2;
-          /**********pruning 1 */
-          std::vector<att_label_t<att_t>> cand_att_label_vec;
-          for (int i = 0; i < nn_allc.size(); ++i) {
-            cand_att_label_vec.emplace_back(*GetAttByInternalID(nn_allc[i].id_), *GetLabelByInternalID(nn_allc[i].id_));
-          }
-          nn_allc = order_table_->GetInWindowCandidates(
-              nn_allc, cand_att_label_vec, {*GetAttByInternalID(nn_i), *GetLabelByInternalID(nn_i)}, half_window_size);
-          nn_allc.emplace_back(nn_d, cur_num);
-          /**********pruning 2 */
-          auto nn_pruned = PruneByHeuristic(nn_allc, M_);
-          nn_ll[M_]      = (tableint)nn_pruned.size();
-          for (tableint i = 0; i < nn_ll[M_]; ++i) {
-            nn_ll[i] = nn_pruned[i].id_;
-          }
+    UpdateMean();
+    std::vector<dist_id_pair> nearest;
+    for (tableint i = 0; vec_count_ > 0 && i < curvec_num_; ++i) {
+      if (!IsDeleted(i)) {
+        PUSH_HEAP(nearest, fstdistfunc_(vec_mean_.data(), GetVecByInternalID(i), dist_func_param_), i);
+        if (nearest.size() > kNumHubs) {
+          POP_HEAP(nearest);
         }
       }
     }
-    order_table_->InsertAttInid({*GetAttByInternalID(cur_num), *GetLabelByInternalID(cur_num)}, cur_num);
+    std::sort(nearest.begin(), nearest.end());
+    for (size_t i = 0; i < nearest.size(); ++i) {
+      hubs_[i].store(nearest[i].id_, std::memory_order_relaxed);
+    }
   }
 
-  template <typename filter_t = wow_range<att_t>>
-  auto searchKNN(const vec_t *query_vec, size_t efs, size_t k, const filter_t &filter)
-      -> std::vector<std::pair<dist_t, label_t>>
+  // order table keys reference attributes inside the element slots, rebuild it after the slots have moved
+  void RebindOrderTable()
+  {
+    std::stringstream ss;
+    order_table_->Serialize(ss);
+    OrderTable<att_t> *rebound;
+    if (dynamic_cast<StaticOrderTable<att_t> *>(order_table_) != nullptr) {
+      rebound = new StaticOrderTable<att_t>(max_elements_);
+    } else {
+      rebound = new WBTreeOrderTable<att_t>(max_elements_);
+    }
+    rebound->Deserialize(ss, curvec_num_, [this](tableint id) -> const att_t & { return *GetAttByInternalID(id); });
+    delete order_table_;
+    order_table_ = rebound;
+  }
+
+  /**
+   * @brief fill ctx.result_ with the (at most k) nearest neighbors as a max-heap on distance
+   */
+  template <typename filter_t>
+  void SearchKNNInto(const vec_t *query_vec, size_t efs, size_t k, const filter_t &filter, SearchContext &ctx,
+      std::optional<SearchPlan> plan = std::nullopt)
   {
     // compiler check: filter should be one of the following types:
-    // wow_range<att_t> wow_bitset<label_t> wow_bitset<int> wow_set<att_t>
-    wow_range<layer_t>        layer_rng;
-    std::vector<dist_id_pair> ep_dist_id_pairs;
-    constexpr bool            check_filter = should_check_filter(filter_t, att_t);
-    if constexpr (!check_filter) {
-      // randomly select a ep from 0-curvec_num_-1
-      auto ep_id = rand() % curvec_num_;
-      auto d     = fstdistfunc_(query_vec, GetVecByInternalID(ep_id), dist_func_param_);
-      metric_dist_comps_++;
-      ep_dist_id_pairs.emplace_back(d, ep_id);
+    // wow_range<att_t> wow_multi_range<att_t> wow_bitset<label_t> wow_bitset<int> wow_set<att_t> wow_unfiltered
+    wow_range<layer_t> layer_rng;
+    auto              &ep_dist_id_pairs = ctx.eps_;
+    ep_dist_id_pairs.clear();
+    if (curvec_num_ == 0) {
+      // nothing to start from, e.g. an index frozen or saved while empty
+      ctx.result_.clear();
+      return;
+    }
+    const void *query = query_vec;
+    if (quantizer_ != nullptr) {
+      ctx.query_buf_.resize(quantizer_->GetQueryBufSize());
+      quantizer_->PrepareQuery(AsFloat(query_vec, ctx.query_float_), ctx.query_buf_.data());
+      query = ctx.query_buf_.data();
+    }
+    constexpr bool check_filter = should_check_filter(filter_t, att_t);
+    constexpr bool range_filter =
+        std::is_same_v<filter_t, wow_range<att_t>> || std::is_same_v<filter_t, wow_multi_range<att_t>>;
+    size_t filter_card = 0;
+    ctx.plan_          = check_filter ? SearchPlan::kWindowGraph : SearchPlan::kTopLayer;
+    if (!range_filter && plan.has_value() && *plan != ctx.plan_) {
+      throw std::runtime_error(std::string("only range searches can be answered by ") + SearchPlanName(*plan));
+    }
+    if constexpr (range_filter) {
+      // the intervals of a multi-range add up, each one contributes the entry points at its bounds
+      ctx.ep_ids_.clear();
+      ForEachInterval(filter, [&](const att_t &l, const att_t &u) {
+        filter_card += order_table_->GetRangeCardinality({l, 0}, {u, std::numeric_limits<label_t>::max()}, ctx.ep_ids_);
+      });
+      ctx.plan_ = plan.has_value() ? *plan : PlanRangeSearch(filter_card, efs);
+      if (ctx.plan_ == SearchPlan::kExactScan) {
+        ExactScan(query_vec, filter, k, ctx);
+        return;
+      }
+    }
+    if (ctx.plan_ == SearchPlan::kTopLayer) {
+      // start from the hubs near the mean vector, or from a random element while there are none
+      for (auto &hub : hubs_) {
+        tableint ep_id = hub.load(std::memory_order_relaxed);
+        if (ep_id != kNoHub) {
+          auto d = qdistfunc_(query, GetCodeByInternalID(ep_id), qdist_func_param_);
+          metric_dist_comps_++;
+          ep_dist_id_pairs.emplace_back(d, ep_id);
+        }
+      }
+      if (ep_dist_id_pairs.empty()) {
+        tableint ep_id = ThreadRng()() % curvec_num_;
+        auto     d     = qdistfunc_(query, GetCodeByInternalID(ep_id), qdist_func_param_);
+        metric_dist_comps_++;
+        ep_dist_id_pairs.emplace_back(d, ep_id);
+      }
       layer_rng = {static_cast<layer_t>(cur_max_layer_), static_cast<layer_t>(cur_max_layer_)};
-    } else if constexpr (std::is_same_v<filter_t, wow_range<att_t>>) {
-      std::vector<tableint> eps;
-      layer_rng = DecideLayerRange(filter, eps);
+    } else if constexpr (range_filter) {
+      layer_rng = DecideLayerRange(filter_card);
+      if constexpr (std::is_same_v<filter_t, wow_multi_range<att_t>>) {
+        if (filter.l_.size() > 1) {
+          SeedIntervals(query, filter, std::max(k, efs / filter.l_.size()), ctx);
+        }
+      }
+      if (ep_dist_id_pairs.empty()) {
+        for (auto ep_id : ctx.ep_ids_) {
+          auto d = qdistfunc_(query, GetCodeByInternalID(ep_id), qdist_func_param_);
+          metric_dist_comps_++;
+          ep_dist_id_pairs.emplace_back(d, ep_id);
+        }
+      }
+    } else if constexpr (std::is_same_v<filter_t, wow_set<att_t>>) {
+      // entry points are looked up per set member in the order table, the members share the efs budget
+      auto &eps = ctx.ep_ids_;
+      eps.clear();
+      for (size_t i = 0; i < filter.set_.size() && eps.size() < efs; ++i) {
+        const att_t &att = filter.set_[i];
+        order_table_->GetRangeIds({att, 0}, {att, std::numeric_limits<label_t>::max()}, eps,
+            std::max<size_t>((efs - eps.size()) / (filter.set_.size() - i), 1));
+      }
       for (auto ep_id : eps) {
-        auto d = fstdistfunc_(query_vec, GetVecByInternalID(ep_id), dist_func_param_);
+        auto d = qdistfunc_(query, GetCodeByInternalID(ep_id), qdist_func_param_);
         metric_dist_comps_++;
         ep_dist_id_pairs.emplace_back(d, ep_id);
       }
-    } else {  // wow_set<att_t>
+      layer_rng = {0, static_cast<layer_t>(cur_max_layer_)};
+    } else if constexpr (check_filter) {
       for (tableint i = 0; i < curvec_num_; ++i) {
         if (ep_dist_id_pairs.size() >= efs) {
           break;
         }
-        if (filter.Test(*GetAttByInternalID(i))) {
-          auto d = fstdistfunc_(query_vec, GetVecByInternalID(i), dist_func_param_);
+        if (filter.Test(*GetAttByInternalID(i)) && !IsDeleted(i)) {
+          auto d = qdistfunc_(query, GetCodeByInternalID(i), qdist_func_param_);
           metric_dist_comps_++;
           ep_dist_id_pairs.emplace_back(d, i);
         }
@@ -373,80 +2263,252 @@ public:
       layer_rng = {0, static_cast<layer_t>(cur_max_layer_)};
     }
 
-    std::vector<dist_id_pair> result;
-    if constexpr (std::is_same_v<filter_t, wow_range<att_t>>) {
+    if (ctx.plan_ == SearchPlan::kTopLayer) {
+      size_t top_efs = efs;
+      if constexpr (range_filter) {
+        // widen the beam so that about efs of it pass the filter
+        size_t live = LiveCount();
+        top_efs     = std::max(efs, std::min<size_t>(efs * (double)live / std::max<size_t>(filter_card, 1), live));
+      }
+      SearchCandidates<false>(ep_dist_id_pairs, query, 0, layer_rng, top_efs, ctx);
+      if constexpr (range_filter) {
+        auto &result = ctx.result_;
+        result.erase(std::remove_if(result.begin(), result.end(),
+                         [&](const dist_id_pair &r) { return !filter.Test(*GetAttByInternalID(r.id_)); }),
+            result.end());
+        if (result.size() < std::min(k, filter_card)) {
+          // the range is not spread evenly over the beam, too few of it passed. answer with the windowed search
+          SearchKNNInto(query_vec, efs, k, filter, ctx, SearchPlan::kWindowGraph);
+          return;
+        }
+        std::make_heap(result.begin(), result.end());
+      }
+    } else if constexpr (std::is_same_v<filter_t, wow_range<att_t>>) {
       wow_range<att_label_t<att_t>> dedup_filter{{filter.l_, 0}, {filter.u_, std::numeric_limits<label_t>::max()}};
-      result = SearchCandidates<false>(ep_dist_id_pairs, query_vec, dedup_filter, layer_rng, efs);
+      if (!order_ranks_.empty()) {
+        // frozen: neighbors are tested on their rank instead of comparing attributes and labels
+        auto [first, last] = static_cast<StaticOrderTable<att_t> *>(order_table_)->GetRankRange(
+            dedup_filter.l_, dedup_filter.u_);
+        wow_rank_range<att_t> rank_filter{(tableint)first, (tableint)(last - first), filter};
+        SearchCandidates<false>(ep_dist_id_pairs, query, rank_filter, layer_rng, efs, ctx);
+      } else {
+        SearchCandidates<false>(ep_dist_id_pairs, query, dedup_filter, layer_rng, efs, ctx);
+      }
     } else {
-      result = SearchCandidates<false>(ep_dist_id_pairs, query_vec, filter, layer_rng, efs);
+      SearchCandidates<false>(ep_dist_id_pairs, query, filter, layer_rng, efs, ctx);
     }
 
+    auto &result = ctx.result_;
+    if (quantizer_ != nullptr) {
+      // traversal distances are approximate, rerank the whole beam with the full precision vectors
+      for (auto &r : result) {
+        r.dist_ = fstdistfunc_(query_vec, GetVecByInternalID(r.id_), dist_func_param_);
+      }
+      metric_dist_comps_ += result.size();
+      std::make_heap(result.begin(), result.end());
+    }
     while (result.size() > k) {
       POP_HEAP(result);
     }
-    std::vector<std::pair<dist_t, label_t>> final_res(result.size());
-    for (int i = 0; i < final_res.size(); ++i) {
-      final_res[i].first  = result[i].dist_;
-      final_res[i].second = *GetLabelByInternalID(result[i].id_);
-    }
-    return final_res;
   }
 
-  inline __attribute__((always_inline)) auto GetDimension() const -> size_t { return vec_d_; }
-  inline __attribute__((always_inline)) auto GetMaxElements() const -> size_t { return max_elements_; }
-  inline __attribute__((always_inline)) auto GetCurNum() const -> size_t { return curvec_num_; }
-  inline __attribute__((always_inline)) auto GetCurMaxLayer() const -> size_t { return cur_max_layer_; }
-  inline __attribute__((always_inline)) auto GetM() const -> size_t { return M_; }
-  inline __attribute__((always_inline)) auto GetEfc() const -> size_t { return efc_; }
-
-private:
-  // always inline
-  inline __attribute__((always_inline)) auto GetLabelByInternalID(tableint internal_id) -> label_t *
+  /**
+   * @brief entry points for a multi-range search in ctx.eps_, the best ef elements of a search in each interval
+   *
+   * the graph links no interval to another, so the elements at the bounds of a far interval would be left behind by
+   * the beam of the others, whatever the interval holds.
+   */
+  void SeedIntervals(const void *query, const wow_multi_range<att_t> &filter, size_t ef, SearchContext &ctx)
   {
-    return (label_t *)(linklistsmemory_ + internal_id * sizelinks_per_element_ + offset_label_);
+    auto &seeds = ctx.seeds_;
+    seeds.clear();
+    for (size_t i = 0; i < filter.l_.size(); ++i) {
+      auto &eps = ctx.eps_;
+      eps.clear();
+      ctx.ep_ids_.clear();
+      wow_range<att_label_t<att_t>> interval{{filter.l_[i], 0}, {filter.u_[i], std::numeric_limits<label_t>::max()}};
+      size_t                        card = order_table_->GetRangeCardinality(interval.l_, interval.u_, ctx.ep_ids_);
+      for (auto ep_id : ctx.ep_ids_) {
+        eps.emplace_back(qdistfunc_(query, GetCodeByInternalID(ep_id), qdist_func_param_), ep_id);
+      }
+      metric_dist_comps_ += ctx.ep_ids_.size();
+      SearchCandidates<false>(eps, query, interval, DecideLayerRange(card), ef, ctx);
+      seeds.insert(seeds.end(), ctx.result_.begin(), ctx.result_.end());
+    }
+    ctx.eps_.swap(seeds);
   }
 
-  inline __attribute__((always_inline)) auto GetAttByInternalID(tableint internal_id) -> att_t *
+  // calls fn(l, u) for the interval of a wow_range or every interval of a wow_multi_range
+  template <typename filter_t, typename fn_t>
+  static void ForEachInterval(const filter_t &filter, fn_t &&fn)
   {
-    return (att_t *)(linklistsmemory_ + internal_id * sizelinks_per_element_ + offset_att_);
+    if constexpr (std::is_same_v<filter_t, wow_range<att_t>>) {
+      fn(filter.l_, filter.u_);
+    } else {
+      for (size_t i = 0; i < filter.l_.size(); ++i) {
+        fn(filter.l_[i], filter.u_[i]);
+      }
+    }
   }
 
-  inline __attribute__((always_inline)) auto GetVecByInternalID(tableint internal_id) -> vec_t *
+  // elements a search can return
+  inline __attribute__((always_inline)) auto LiveCount() const -> size_t { return curvec_num_ - num_deleted_; }
+
+  // ranges above exact_scan_threshold_ are never scanned, whatever the planner estimates
+  auto PlanRangeSearch(size_t filter_card, size_t efs) const -> SearchPlan
   {
-    return (vec_t *)(linklistsmemory_ + internal_id * sizelinks_per_element_ + offset_vec_);
+    auto plan = planner_->Plan({filter_card, LiveCount(), efs}, getPlanCosts());
+    if (plan == SearchPlan::kExactScan && filter_card > exact_scan_threshold_) {
+      return SearchPlan::kWindowGraph;
+    }
+    return plan;
   }
 
-  inline __attribute__((always_inline)) auto GetLinkListByInternalID(tableint internal_id, layer_t layer) -> tableint *
+  /**
+   * @brief the k nearest elements of a range or multi-range into ctx.result_ (max-heap), by scoring every element in
+   * it with the full precision vectors
+   *
+   * the order table hands out the ids in key order, vectors are prefetched kScanPrefetch elements ahead of the
+   * distance kernel.
+   */
+  template <typename filter_t>
+  void ExactScan(const vec_t *query_vec, const filter_t &filter, size_t k, SearchContext &ctx)
   {
-    // store layers reversely to prefetch the next layer
-    return (tableint *)(linklistsmemory_ + internal_id * sizelinks_per_element_ + offset_linklists_ +
-                        (wp_ - layer) * (M_ + 1) * sizeof(tableint));
+    auto &ids = ctx.scan_ids_;
+    ids.clear();
+    ForEachInterval(filter, [&](const att_t &l, const att_t &u) {
+      order_table_->GetRangeIds({l, 0}, {u, std::numeric_limits<label_t>::max()}, ids);
+    });
+    auto &result = ctx.result_;
+    result.clear();
+    for (size_t i = 0; i < ids.size(); ++i) {
+#ifdef USE_SSE
+      if (i + kScanPrefetch < ids.size()) {
+        auto next = (const char *)GetVecByInternalID(ids[i + kScanPrefetch]);
+        for (size_t line = 0; line < sizeof(vec_t) * vec_d_; line += 64) {
+          _mm_prefetch(next + line, _MM_HINT_T0);
+        }
+      }
+#endif
+      auto d = fstdistfunc_(query_vec, GetVecByInternalID(ids[i]), dist_func_param_);
+      if (result.size() < k || d < TOP_HEAP(result).dist_) {
+        PUSH_HEAP(result, d, ids[i]);
+        if (result.size() > k) {
+          POP_HEAP(result);
+        }
+      }
+    }
+    metric_dist_comps_ += ids.size();
   }
 
   template <bool is_build, typename filter_t>
-  auto SearchCandidates(std::vector<dist_id_pair> &eps, const vec_t *v, const filter_t &filter,
+  auto SearchCandidates(const std::vector<dist_id_pair> &eps, const void *v, const filter_t &filter,
       const wow_range<layer_t> &layer_rng, const size_t ef, tableint ignore = -1) -> std::vector<dist_id_pair>
+  {
+    auto &ctx = GetThreadSearchContext();
+    SearchCandidates<is_build>(eps, v, filter, layer_rng, ef, ctx, ignore);
+    return ctx.result_;
+  }
+
+  /**
+   * @brief best-first search from eps, the ef nearest candidates are left in ctx.result_ as a max-heap
+   *
+   * builds compare the full precision vector v, searches compare the prepared query v against the codes.
+   */
+  template <bool is_build, typename filter_t>
+  void SearchCandidates(const std::vector<dist_id_pair> &eps, const void *v, const filter_t &filter,
+      const wow_range<layer_t> &layer_rng, const size_t ef, SearchContext &ctx, tableint ignore = -1)
   {
     constexpr bool check_filter = should_check_filter(filter_t, att_t);
+    auto          &result       = ctx.result_;
+    auto          &candidates   = ctx.candidates_;
+    result.clear();
+    candidates.clear();
     if (eps.empty())
-      return {};
-    auto visited = visited_pool_.Get();
+      return;
+    auto visited = &ctx.visited_;
     visited->Clear();
-    if (is_build && ignore != -1) {
+    if (is_build && ignore != (tableint)-1) {
       visited->Set(ignore);
     }
+    // deleted elements are expanded for routing but never enter the result
+    bool skip_deleted = num_deleted_.load(std::memory_order_relaxed) > 0;
+    // key masks are 64 bit, larger lists test every neighbor
+    bool use_keys = !link_keys_.Empty() && M_ <= 64;
+    // a frozen index may keep its lists as layer runs, see CompactLinks
+    bool     compact      = !compact_offsets_.empty();
+    uint32_t range_layers = compact ? LayerBits(layer_rng.l_, layer_rng.u_) : 0;
     // std::vector<dist_id_pair> visited_pairs;
-    std::vector<dist_id_pair> result;
-    std::vector<dist_id_pair> candidates;
     for (auto ep : eps) {
       PUSH_HEAP(candidates, -ep.dist_, ep.id_);
-      PUSH_HEAP(result, ep.dist_, ep.id_);
+      if (!skip_deleted || !IsDeleted(ep.id_)) {
+        PUSH_HEAP(result, ep.dist_, ep.id_);
+      }
       visited->Set(ep.id_);
       // if constexpr (is_build) {
       //   visited_pairs.emplace_back(ep.dist_, ep.id_);
       // }
     }
-    auto res_max_dist = TOP_HEAP(result).dist_;
+    auto res_max_dist = result.empty() ? std::numeric_limits<dist_t>::max() : TOP_HEAP(result).dist_;
+    // what the filter test of nn_id reads
+    auto filter_data = [&](tableint nn_id) -> const char * {
+      if constexpr (std::is_same_v<filter_t, wow_rank_range<att_t>>) {
+        return (const char *)&order_ranks_[nn_id];
+      } else {
+        return (const char *)GetAttByInternalID(nn_id);
+      }
+    };
+    // false if nn_id fails the filter, otherwise it is scored unless already visited
+    auto visit_neighbor = [&](tableint nn_id, size_t &neighbor_cnt) -> bool {
+      auto &nn_att = *GetAttByInternalID(nn_id);
+      if constexpr (check_filter) {
+        if constexpr (std::is_same_v<filter_t, wow_rank_range<att_t>>) {
+          auto rank = order_ranks_[nn_id];
+          if (!filter.Test(rank) && (rank != kNoRank || !filter.att_.Test(nn_att))) {
+            return false;
+          }
+        } else if constexpr (std::is_same_v<filter_t, wow_range<att_label_t<att_t>>>) {
+          if (!filter.Test({nn_att, *GetLabelByInternalID(nn_id)})) {
+            return false;
+          }
+        } else {
+          if (!filter.Test(nn_att)) {
+            return false;
+          }
+        }
+      }
+      if (visited->Test(nn_id)) {
+        return true;
+      }
+      visited->Set(nn_id);
+      dist_t nn_dist;
+      if constexpr (is_build) {
+        nn_dist = fstdistfunc_(v, GetVecByInternalID(nn_id), dist_func_param_);
+      } else {
+        nn_dist = qdistfunc_(v, GetCodeByInternalID(nn_id), qdist_func_param_);
+      }
+      metric_dist_comps_++;
+      neighbor_cnt++;
+      // if constexpr (is_build) {
+      //   visited_pairs.emplace_back(nn_dist, nn_id);
+      // }
+      if (result.size() < ef || nn_dist < res_max_dist) {
+        PUSH_HEAP(candidates, -nn_dist, nn_id);
+#ifdef USE_SSE
+        _mm_prefetch(compact ? (char *)&compact_offsets_[TOP_HEAP(candidates).id_]
+                             : links_store_->At(TOP_HEAP(candidates).id_),
+            _MM_HINT_T2);
+#endif
+        if (!skip_deleted || !IsDeleted(nn_id)) {
+          PUSH_HEAP(result, nn_dist, nn_id);
+          if (result.size() > ef) {
+            POP_HEAP(result);
+          }
+          res_max_dist = TOP_HEAP(result).dist_;
+        }
+      }
+      return true;
+    };
     while (!candidates.empty()) {
       auto [dist, id] = TOP_HEAP(candidates);
       if constexpr (is_build) {
@@ -460,25 +2522,71 @@ private:
       }
 
 #ifdef USE_SSE
-      _mm_prefetch((char *)GetLinkListByInternalID(id, layer_rng.u_), _MM_HINT_T2);
+      _mm_prefetch(compact ? (char *)&compact_edges_[compact_offsets_[id]]
+                           : (char *)GetLinkListByInternalID(id, layer_rng.u_),
+          _MM_HINT_T2);
 #endif
       POP_HEAP(candidates);
       metric_hops_++;
+      size_t neighbor_cnt = 0;
+
+      if (compact) {
+        // one pass over the layer runs, ordered like the layered scan below: a run counts for the highest layer of the
+        // range it covers, and the scan leaves after the first layer without a filtered out neighbor
+        uint32_t failed    = 0;
+        layer_t  cur_layer = layer_rng.u_;
+        for (uint64_t e = compact_offsets_[id]; e < compact_offsets_[id + 1] && neighbor_cnt < M_; ++e) {
+          uint32_t layers = compact_edges_[e].layers_ & range_layers;
+          if (layers == 0) {
+            continue;
+          }
+          layer_t layer = 31 - __builtin_clz(layers);
+          if (layer < cur_layer) {
+            if ((LayerBits(layer + 1, cur_layer) & ~failed) != 0) {
+              break;
+            }
+            cur_layer = layer;
+          }
+          auto nn_id = compact_edges_[e].id_;
+#ifdef USE_SSE
+          _mm_prefetch((char *)(visited->GetData(compact_edges_[e + 1].id_)), _MM_HINT_T0);
+          _mm_prefetch(filter_data(compact_edges_[e + 1].id_), _MM_HINT_T0);
+#endif
+          if constexpr (!is_build && kKeyFilter<filter_t, att_t>) {
+            if (!compact_keys_.empty() && !KeyMayPass(filter, compact_keys_[e])) {
+              failed |= layers;
+              continue;
+            }
+          }
+          if (!visit_neighbor(nn_id, neighbor_cnt)) {
+            failed |= layers;
+          }
+        }
+        continue;
+      }
 
       if constexpr (is_build)
         linklist_locks_[id].lock();
-      size_t neighbor_cnt = 0;
 
       for (layer_t layer = layer_rng.u_; layer >= layer_rng.l_; --layer) {
         if (neighbor_cnt >= M_) {
           break;
         }
+        // skip the layers that would only repeat a lower list
+        layer      = ResolveLayer(id, layer);
         auto ll    = GetLinkListByInternalID(id, layer);
-        auto ll_sz = ll[M_];
+        auto ll_sz = LoadListSize(ll);
+        // neighbors whose key fails the filter are skipped without touching them
+        uint64_t key_mask = ~uint64_t(0);
+        if constexpr (!is_build && kKeyFilter<filter_t, att_t>) {
+          if (use_keys) {
+            key_mask = KeyMask(filter, GetLinkKeysByInternalID(id, layer), ll_sz);
+          }
+        }
 #ifdef USE_SSE
         _mm_prefetch((char *)(visited->GetData(ll[0])), _MM_HINT_T0);
         _mm_prefetch((char *)(visited->GetData(ll[0]) + 64), _MM_HINT_T0);
-        _mm_prefetch((char *)(GetAttByInternalID(ll[0])), _MM_HINT_T0);
+        _mm_prefetch(filter_data(ll[0]), _MM_HINT_T0);
         _mm_prefetch((char *)(ll + 1), _MM_HINT_T0);
 #endif
         bool visit_next_layer = false;
@@ -486,45 +2594,17 @@ private:
           if (neighbor_cnt >= M_) {
             break;
           }
-          auto nn_id = ll[i];
-#ifdef USE_SSE
-          _mm_prefetch((char *)(visited->GetData(ll[i + 1])), _MM_HINT_T0);
-          _mm_prefetch((char *)(GetAttByInternalID(ll[i + 1])), _MM_HINT_T0);
-#endif
-          auto &nn_att = *GetAttByInternalID(nn_id);
-          if constexpr (check_filter) {
-            if constexpr (std::is_same_v<filter_t, wow_range<att_label_t<att_t>>>) {
-              if (!filter.Test({nn_att, *GetLabelByInternalID(nn_id)})) {
-                visit_next_layer = true;
-                continue;
-              }
-            } else {
-              if (!filter.Test(nn_att)) {
-                visit_next_layer = true;
-                continue;
-              }
-            }
-          }
-          if (visited->Test(nn_id)) {
+          if (use_keys && ((key_mask >> i) & 1) == 0) {
+            visit_next_layer = true;
             continue;
           }
-          visited->Set(nn_id);
-          auto nn_dist = fstdistfunc_(v, GetVecByInternalID(nn_id), dist_func_param_);
-          metric_dist_comps_++;
-          neighbor_cnt++;
-          // if constexpr (is_build) {
-          //   visited_pairs.emplace_back(nn_dist, nn_id);
-          // }
-          if (result.size() < ef || nn_dist < res_max_dist) {
-            PUSH_HEAP(candidates, -nn_dist, nn_id);
+          auto nn_id = ll[i];
 #ifdef USE_SSE
-            _mm_prefetch((char *)linklistsmemory_ + TOP_HEAP(candidates).id_ * sizelinks_per_element_, _MM_HINT_T2);
+          _mm_prefetch((char *)(visited->GetData(ll[i + 1])), _MM_HINT_T0);
+          _mm_prefetch(filter_data(ll[i + 1]), _MM_HINT_T0);
 #endif
-            PUSH_HEAP(result, nn_dist, nn_id);
-            if (result.size() > ef) {
-              POP_HEAP(result);
-            }
-            res_max_dist = TOP_HEAP(result).dist_;
+          if (!visit_neighbor(nn_id, neighbor_cnt)) {
+            visit_next_layer = true;
           }
         }
         if (!is_build && !visit_next_layer) {
@@ -534,12 +2614,6 @@ private:
       if (is_build)
         linklist_locks_[id].unlock();
     }
-    visited_pool_.Return(visited);
-    // if constexpr (is_build) {
-    //   return visited_pairs;
-    // } else {
-    return result;
-    // }
   }
 
   auto PruneByHeuristic(std::vector<dist_id_pair> &candidates, const size_t M) -> std::vector<dist_id_pair>
@@ -584,19 +2658,18 @@ private:
     return pruned;
   }
 
-  auto DecideLayerRange(const wow_range<att_t> &filter_range, std::vector<tableint> &OUT_eps) -> wow_range<layer_t>
+  auto DecideLayerRange(size_t filter_card) -> wow_range<layer_t>
   {
     wow_range<layer_t> new_layer_rng;
-    size_t             filter_card = order_table_->GetRangeCardinality(
-        {filter_range.l_, 0}, {filter_range.u_, std::numeric_limits<label_t>::max()}, OUT_eps);
-    auto c_it = std::lower_bound(window_size_.begin(), window_size_.end(), filter_card);
-    if (c_it == this->window_size_.end() || *c_it > filter_card) {
+    auto               c_it = std::lower_bound(window_size_.begin(), window_size_.end(), filter_card);
+    // a range smaller than the first window uses the lowest layers
+    if (c_it == this->window_size_.end() || (*c_it > filter_card && c_it != window_size_.begin())) {
       c_it--;
     }
     int c_it_idx = std::distance(window_size_.begin(), c_it);
     if (c_it_idx == 0) {
       new_layer_rng.u_ = c_it_idx + 1;
-    } else if (c_it_idx == wp_) {
+    } else if (c_it_idx == (int)wp_) {
       new_layer_rng.u_ = c_it_idx;
     } else {
       int c_l = c_it_idx - 1;
@@ -620,15 +2693,18 @@ public:
   size_t metric_hops_{0};
 
 private:
-  size_t max_elements_{0};
-  size_t vec_d_;
-  size_t wp_{0};
-  size_t o_{4};
-  size_t M_{24};
-  size_t efc_{256};
+  size_t      max_elements_{0};
+  size_t      vec_d_;
+  size_t      wp_{0};
+  size_t      o_{4};
+  size_t      M_{24};
+  size_t      efc_{256};
+  std::string space_name_;
 
-  size_t curvec_num_{0};
-  size_t cur_max_layer_{0};
+  std::atomic<size_t> curvec_num_{0};
+  std::atomic<size_t> cur_max_layer_{0};
+  // set once element 0 is in the order table, later inserts start from it
+  std::atomic<bool>   first_inserted_{false};
 
   size_t sizelinks_per_element_{0};
   size_t sizelinklistsmem_{0};
@@ -638,16 +2714,116 @@ private:
   size_t offset_vec_{0};
   size_t offset_linklists_{0};
 
-  char *linklistsmemory_{nullptr};
+  // one slot of sizelinks_per_element_ bytes per element, holding layers [0, slot_wp_]
+  SegmentedStorage elements_;
+  // split layout: vectors (or codes) and link lists apart from the label and attribute records in elements_
+  ElementLayout    layout_{ElementLayout::kInterleaved};
+  SegmentedStorage vecs_;
+  SegmentedStorage links_;
+  // where vectors and link lists are read, elements_ or the split arrays, see InitElementStorage
+  SegmentedStorage *vecs_store_{&elements_};
+  SegmentedStorage *links_store_{&elements_};
+  size_t            vecs_offset_{0};
+  size_t            links_offset_{0};
+  // layers slot_wp_ + 1 .. wp_ added by resizeIndex, one (M_ + 1) tableint list per element each
+  std::vector<std::unique_ptr<SegmentedStorage>> upper_links_;
+  size_t                                         slot_wp_{0};
+  // set when elements_ adopts a file mapping
+  char  *mmap_base_{nullptr};
+  size_t mmap_len_{0};
+  bool   read_only_{false};
+
+  static constexpr size_t kQuantizerTrainSize = 100000;
+  QuantizerInterface     *quantizer_{nullptr};
+  // full precision vectors of a quantized index, one vec_d_ record per element, allocated or mapped with the elements
+  SegmentedStorage        full_vecs_;
+  // distance between a prepared query and what GetCodeByInternalID returns
+  DISTFUNC<dist_t>        qdistfunc_{nullptr};
+  const void             *qdist_func_param_{nullptr};
+  // build only, see cache_edge_dists
+  SegmentedStorage        edge_dists_;
+  // (wp_ + 1) * M_ neighbor attributes per element, see enableNeighborKeys
+  SegmentedStorage        link_keys_;
+  // a neighbor and the contiguous layers (bit l: layer l) whose list holds it, see CompactLinks
+  struct CompactEdge
+  {
+    tableint id_;
+    uint32_t layers_;
+  };
+  // runs of element i are [compact_offsets_[i], compact_offsets_[i + 1]), followed by one sentinel run
+  std::vector<uint64_t>    compact_offsets_;
+  std::vector<CompactEdge> compact_edges_;
+  std::vector<att_t>       compact_keys_;  // neighbor keys of a compacted index, one per run
+  // range filters with more elements are never answered by ExactScan, see setExactScanThreshold
+  size_t                        exact_scan_threshold_{4096};
+  static constexpr size_t       kScanPrefetch = 4;  // elements between a vector prefetch and its distance
+  // picks the plan of every range search, see calibratePlanner
+  std::unique_ptr<QueryPlanner> planner_{std::make_unique<CostModelPlanner>()};
+  // plan_costs_ is only read once plan_costs_set_, default_plan_costs_ before
+  PlanCosts                     plan_costs_;
+  PlanCosts                     default_plan_costs_;
+  std::atomic<bool>             plan_costs_set_{false};
+  static constexpr size_t       kCalibrateScanSize = 1024;
+  static constexpr size_t       kCalibrateK        = 10;
+  // frozen only: rank of each element in the StaticOrderTable, range filters become rank spans (wow_rank_range)
+  static constexpr tableint kNoRank = std::numeric_limits<tableint>::max();
+  std::vector<tableint>     order_ranks_;
 
-  std::mutex              max_layer_lock_;
   std::vector<std::mutex> linklist_locks_;
-  // function pointer to float (const float *, const float *, size_t d)
-  wowlib::SpaceInterface<vec_t> *space_{nullptr};
-  wowlib::DISTFUNC<vec_t>        fstdistfunc_{nullptr};
-  void                          *dist_func_param_{nullptr};
+  // search contexts of the threads that searched this index, see GetThreadSearchContext
+  static inline std::atomic<uint64_t>        next_instance_id_{0};
+  const uint64_t                             instance_id_{next_instance_id_++};
+  std::deque<std::unique_ptr<SearchContext>> thread_contexts_;
+  std::mutex                                 thread_contexts_lock_;
+  // tombstones, see markDeleted. free_ids_ holds the deleted slots not yet reused
+  std::vector<std::atomic<bool>> deleted_;
+  std::vector<tableint>          free_ids_;
+  std::mutex                     deleted_lock_;
+  std::atomic<size_t>            num_deleted_{0};
+  // sources of the edges into each element, only kept once track_in_edges_ (see TrackInEdges)
+  static constexpr size_t                    kInEdgeLockStripes = 64;
+  std::vector<std::vector<tableint>>         in_edges_;
+  std::array<std::mutex, kInEdgeLockStripes> in_edge_locks_;
+  std::atomic<bool>                          track_in_edges_{false};
+  std::mutex                                 in_edges_init_lock_;
+  // entry points of unfiltered searches: the live elements nearest to the mean vector, an approximate medoid kept by
+  // insert and markDeleted (see UpdateHubs). the sum of the kSumStripes stripes of vec_sums_ (sum_stride_ apart) over
+  // vec_count_ live elements gives the mean, vec_mean_ is only touched under hubs_lock_
+  static constexpr size_t                     kNumHubs          = 4;
+  static constexpr tableint                   kNoHub            = std::numeric_limits<tableint>::max();
+  static constexpr size_t                     kSumStripes       = 16;
+  static constexpr size_t                     kHubRefreshPeriod = 64;
+  std::array<std::atomic<tableint>, kNumHubs> hubs_;
+  std::vector<std::atomic<double>>            vec_sums_;
+  size_t                                      sum_stride_{0};
+  std::atomic<size_t>                         vec_count_{0};
+  std::atomic<size_t>                         hub_updates_{0};
+  std::vector<vec_t>                          vec_mean_;
+  std::mutex                                  hubs_lock_;
+
+  // index file format, see save(). kLabelIndexTag marks the label index in the legacy format
+  static constexpr uint64_t kIndexMagic          = 0x5844494e45574f57;  // "WOWINDEX"
+  static constexpr uint32_t kIndexFormatVersion  = 1;
+  static constexpr uint32_t kSectionElements     = 1;
+  static constexpr uint32_t kSectionOrderTable   = 2;
+  static constexpr uint32_t kSectionLabelIndex   = 3;
+  static constexpr uint32_t kSectionQuantizer    = 4;
+  static constexpr uint32_t kSectionFullVecs     = 5;
+  static constexpr uint32_t kSectionKeys         = 6;  // split layout: labels and attributes, vectors, link lists
+  static constexpr uint32_t kSectionVectors      = 7;
+  static constexpr uint32_t kSectionLinks        = 8;
+  static constexpr uint32_t kSectionLinkKeys     = 9;
+  static constexpr uint32_t kSectionCompactLinks = 10;  // freeze(true): offsets, layer runs and their keys
+  static constexpr uint32_t kSectionCompactKeys  = 11;
+  static constexpr uint32_t kSectionHubs         = 12;  // vec_count_, the summed vec_sums_ and hubs_
+  static constexpr uint64_t kLabelIndexTag       = 0x58444e494c424c57;  // "WLBLINDX"
+  LabelIndex                label_index_;
+  // function pointer to float (const vec_t *, const vec_t *, size_t d)
+  wowlib::SpaceInterface<dist_t> *space_{nullptr};
+  wowlib::DISTFUNC<dist_t>        fstdistfunc_{nullptr};
+  void                           *dist_func_param_{nullptr};
 
-  WBTreeOrderTable<att_t> *order_table_{nullptr};
+  OrderTable<att_t> *order_table_{nullptr};
 
   VisitedPool<VisitedList<tableint>> visited_pool_;
   std::vector<size_t>                window_size_;
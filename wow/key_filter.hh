@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include "utils.hh"
+#include "order_table.hh"
+#include "space_dist.hh"
+
+namespace wowlib {
+
+// filters that can be tested on an attribute alone, i.e. on the neighbor keys stored next to a link list
+template <typename filter_t, typename att_t>
+inline constexpr bool kKeyFilter = std::is_same_v<filter_t, wow_range<att_t>> ||
+                                   std::is_same_v<filter_t, wow_range<att_label_t<att_t>>> ||
+                                   std::is_same_v<filter_t, wow_set<att_t>> ||
+                                   std::is_same_v<filter_t, wow_rank_range<att_t>> ||
+                                   std::is_same_v<filter_t, wow_multi_range<att_t>>;
+
+// whether an element with attribute key may pass filter, see KeyMask
+template <typename att_t, typename filter_t>
+inline __attribute__((always_inline)) auto KeyMayPass(const filter_t &filter, const att_t &key) -> bool
+{
+  if constexpr (std::is_same_v<filter_t, wow_range<att_label_t<att_t>>>) {
+    return key >= filter.l_.att_ && key <= filter.u_.att_;
+  } else if constexpr (std::is_same_v<filter_t, wow_rank_range<att_t>>) {
+    return filter.att_.Test(key);
+  } else {
+    return filter.Test(key);
+  }
+}
+
+// bit i is set if keys[i] lies in [lo, hi], n <= 64
+template <typename att_t>
+inline auto RangeKeyMask(const att_t &lo, const att_t &hi, const att_t *keys, size_t n) -> uint64_t
+{
+  uint64_t mask = 0;
+  size_t   i    = 0;
+#if defined(USE_AVX512)
+  if constexpr (std::is_same_v<att_t, float>) {
+    __m512 vlo = _mm512_set1_ps(lo), vhi = _mm512_set1_ps(hi);
+    for (; i < n; i += 16) {
+      __mmask16 tail = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+      __m512    k    = _mm512_maskz_loadu_ps(tail, keys + i);
+      __mmask16 in   = _mm512_mask_cmp_ps_mask(tail, k, vlo, _CMP_GE_OQ) & _mm512_cmp_ps_mask(k, vhi, _CMP_LE_OQ);
+      mask |= uint64_t(in) << i;
+    }
+  } else if constexpr (std::is_integral_v<att_t> && sizeof(att_t) == 4) {
+    __m512i vlo = _mm512_set1_epi32(lo), vhi = _mm512_set1_epi32(hi);
+    for (; i < n; i += 16) {
+      __mmask16 tail = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+      __m512i   k    = _mm512_maskz_loadu_epi32(tail, keys + i);
+      __mmask16 in;
+      if constexpr (std::is_signed_v<att_t>) {
+        in = _mm512_mask_cmpge_epi32_mask(tail, k, vlo) & _mm512_cmple_epi32_mask(k, vhi);
+      } else {
+        in = _mm512_mask_cmpge_epu32_mask(tail, k, vlo) & _mm512_cmple_epu32_mask(k, vhi);
+      }
+      mask |= uint64_t(in) << i;
+    }
+  }
+#elif defined(USE_AVX)
+  if constexpr (std::is_same_v<att_t, float>) {
+    __m256 vlo = _mm256_set1_ps(lo), vhi = _mm256_set1_ps(hi);
+    for (; i + 8 <= n; i += 8) {
+      __m256 k  = _mm256_loadu_ps(keys + i);
+      __m256 in = _mm256_and_ps(_mm256_cmp_ps(k, vlo, _CMP_GE_OQ), _mm256_cmp_ps(k, vhi, _CMP_LE_OQ));
+      mask |= uint64_t(_mm256_movemask_ps(in)) << i;
+    }
+  }
+#if defined(__AVX2__)
+  else if constexpr (std::is_integral_v<att_t> && sizeof(att_t) == 4) {
+    // AVX2 compares signed, flipping the sign bit orders unsigned keys the same way
+    const int flip = std::is_signed_v<att_t> ? 0 : int(0x80000000u);
+    __m256i   vlo  = _mm256_set1_epi32(int(lo) ^ flip), vhi = _mm256_set1_epi32(int(hi) ^ flip);
+    for (; i + 8 <= n; i += 8) {
+      __m256i k   = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), _mm256_set1_epi32(flip));
+      __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(vlo, k), _mm256_cmpgt_epi32(k, vhi));
+      mask |= uint64_t(~_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xff) << i;
+    }
+  }
+#endif
+#endif
+  for (; i < n; ++i) {
+    mask |= uint64_t(keys[i] >= lo && keys[i] <= hi) << i;
+  }
+  return mask;
+}
+
+/**
+ * @brief bit i is set if keys[i] may pass filter, n <= 64
+ *
+ * an att_label_t range only bounds the attribute here, ties at the bounds are left to the caller, and a rank range is
+ * tested on its attribute range. 4 byte integer and float attributes under a range, a multi-range or a set of up to
+ * kLinearSize intervals or members are compared 16 (AVX-512) or 8 (AVX2) at a time.
+ */
+template <typename att_t, typename filter_t>
+inline auto KeyMask(const filter_t &filter, const att_t *keys, size_t n) -> uint64_t
+{
+  uint64_t mask = 0;
+  if constexpr (std::is_same_v<filter_t, wow_set<att_t>>) {
+    size_t i = 0;
+    if (filter.set_.size() > wow_set<att_t>::kLinearSize) {
+      i = n;
+      for (size_t j = 0; j < n; ++j) {
+        mask |= uint64_t(filter.Test(keys[j])) << j;
+      }
+    }
+#if defined(USE_AVX512)
+    if constexpr (std::is_same_v<att_t, float> || (std::is_integral_v<att_t> && sizeof(att_t) == 4)) {
+      for (; i < n; i += 16) {
+        __mmask16 tail = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __mmask16 in   = 0;
+        if constexpr (std::is_same_v<att_t, float>) {
+          __m512 k = _mm512_maskz_loadu_ps(tail, keys + i);
+          for (float att : filter.set_) {
+            in |= _mm512_mask_cmp_ps_mask(tail, k, _mm512_set1_ps(att), _CMP_EQ_OQ);
+          }
+        } else {
+          __m512i k = _mm512_maskz_loadu_epi32(tail, keys + i);
+          for (att_t att : filter.set_) {
+            in |= _mm512_mask_cmpeq_epi32_mask(tail, k, _mm512_set1_epi32(att));
+          }
+        }
+        mask |= uint64_t(in) << i;
+      }
+    }
+#elif defined(USE_AVX)
+    if constexpr (std::is_same_v<att_t, float>) {
+      for (; i + 8 <= n; i += 8) {
+        __m256 k  = _mm256_loadu_ps(keys + i);
+        __m256 in = _mm256_setzero_ps();
+        for (float att : filter.set_) {
+          in = _mm256_or_ps(in, _mm256_cmp_ps(k, _mm256_set1_ps(att), _CMP_EQ_OQ));
+        }
+        mask |= uint64_t(_mm256_movemask_ps(in)) << i;
+      }
+    }
+#if defined(__AVX2__)
+    else if constexpr (std::is_integral_v<att_t> && sizeof(att_t) == 4) {
+      for (; i + 8 <= n; i += 8) {
+        __m256i k  = _mm256_loadu_si256((const __m256i *)(keys + i));
+        __m256i in = _mm256_setzero_si256();
+        for (att_t att : filter.set_) {
+          in = _mm256_or_si256(in, _mm256_cmpeq_epi32(k, _mm256_set1_epi32(att)));
+        }
+        mask |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(in))) << i;
+      }
+    }
+#endif
+#endif
+    for (; i < n; ++i) {
+      mask |= uint64_t(filter.Test(keys[i])) << i;
+    }
+    return mask;
+  } else if constexpr (std::is_same_v<filter_t, wow_multi_range<att_t>>) {
+    if (filter.l_.size() > wow_multi_range<att_t>::kLinearSize) {
+      for (size_t i = 0; i < n; ++i) {
+        mask |= uint64_t(filter.Test(keys[i])) << i;
+      }
+      return mask;
+    }
+    for (size_t j = 0; j < filter.l_.size(); ++j) {
+      mask |= RangeKeyMask(filter.l_[j], filter.u_[j], keys, n);
+    }
+    return mask;
+  } else {
+    att_t lo, hi;
+    if constexpr (std::is_same_v<filter_t, wow_range<att_t>>) {
+      lo = filter.l_;
+      hi = filter.u_;
+    } else if constexpr (std::is_same_v<filter_t, wow_rank_range<att_t>>) {
+      lo = filter.att_.l_;
+      hi = filter.att_.u_;
+    } else {
+      lo = filter.l_.att_;
+      hi = filter.u_.att_;
+    }
+    return RangeKeyMask(lo, hi, keys, n);
+  }
+}
+
+}  // namespace wowlib
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <shared_mutex>
+#include "utils.hh"
+#include "disk.hh"
+
+namespace wowlib {
+
+/**
+ * @brief open addressing label -> internal id map
+ *
+ * buckets hold only internal ids (4 bytes each), the label of an occupied bucket is read back from the element slot
+ * through get_label. linear probing at a load factor below 1/2, erase shifts the rest of the cluster back so there
+ * are no tombstones.
+ */
+class LabelIndex
+{
+public:
+  static constexpr tableint kNotFound = std::numeric_limits<tableint>::max();
+
+  LabelIndex() = default;
+
+  explicit LabelIndex(size_t max_N) { Reset(max_N); }
+
+  void Reset(size_t max_N)
+  {
+    size_t capacity = 16;
+    while (capacity < 2 * max_N) {
+      capacity <<= 1;
+    }
+    buckets_.assign(capacity, kNotFound);
+    mask_ = capacity - 1;
+  }
+
+  // internal id of label, kNotFound if it is not present
+  template <typename get_label_t>
+  auto Find(label_t label, const get_label_t &get_label) -> tableint
+  {
+    std::shared_lock<DistributedSharedMutex> lock(lock_);
+    for (size_t b = Hash(label) & mask_;; b = (b + 1) & mask_) {
+      tableint id = buckets_[b];
+      if (id == kNotFound || get_label(id) == label) {
+        return id;
+      }
+    }
+  }
+
+  // get_label(id) must already return label. false if label is present
+  template <typename get_label_t>
+  auto Insert(label_t label, tableint id, const get_label_t &get_label) -> bool
+  {
+    std::unique_lock<DistributedSharedMutex> lock(lock_);
+    size_t                                   b = Hash(label) & mask_;
+    for (; buckets_[b] != kNotFound; b = (b + 1) & mask_) {
+      if (get_label(buckets_[b]) == label) {
+        return false;
+      }
+    }
+    buckets_[b] = id;
+    return true;
+  }
+
+  // false if label is not present
+  template <typename get_label_t>
+  auto Erase(label_t label, const get_label_t &get_label) -> bool
+  {
+    std::unique_lock<DistributedSharedMutex> lock(lock_);
+    size_t                                   b = Hash(label) & mask_;
+    for (; buckets_[b] == kNotFound || get_label(buckets_[b]) != label; b = (b + 1) & mask_) {
+      if (buckets_[b] == kNotFound) {
+        return false;
+      }
+    }
+    // move back every later entry of the cluster whose home bucket is not between the hole and itself
+    for (size_t j = (b + 1) & mask_; buckets_[j] != kNotFound; j = (j + 1) & mask_) {
+      size_t home = Hash(get_label(buckets_[j])) & mask_;
+      if (((j - home) & mask_) >= ((j - b) & mask_)) {
+        buckets_[b] = buckets_[j];
+        b           = j;
+      }
+    }
+    buckets_[b] = kNotFound;
+    return true;
+  }
+
+  void Serialize(std::ostream &os)
+  {
+    std::shared_lock<DistributedSharedMutex> lock(lock_);
+    size_t                                   capacity = buckets_.size();
+    WriteBinaryPOD(os, capacity);
+    os.write((const char *)buckets_.data(), capacity * sizeof(tableint));
+  }
+
+  /**
+   * @brief read what Serialize wrote, throws if a bucket holds an id at or above num_elements or no bucket is empty
+   *
+   * with check_labels every entry must also be found by its own label (get_label reads the loaded elements), which
+   * reads the label of every element. callers skip it when the checksum of the buckets is verified.
+   */
+  template <typename get_label_t>
+  void Deserialize(
+      std::istream &is, size_t max_N, size_t num_elements, const get_label_t &get_label, bool check_labels = true)
+  {
+    std::unique_lock<DistributedSharedMutex> lock(lock_);
+    size_t                                   capacity;
+    ReadBinaryPOD(is, capacity);
+    if (!is || capacity < 2 * max_N || (capacity & (capacity - 1)) != 0) {
+      throw std::runtime_error("possible index file corruption, invalid label index capacity");
+    }
+    buckets_.resize(capacity);
+    mask_ = capacity - 1;
+    is.read((char *)buckets_.data(), capacity * sizeof(tableint));
+    if (!is) {
+      throw std::runtime_error("possible index file corruption, failed to read the label index");
+    }
+    size_t used = 0;
+    for (auto id : buckets_) {
+      if (id != kNotFound && id >= num_elements) {
+        throw std::runtime_error("possible index file corruption, label index entry out of range");
+      }
+      used += id != kNotFound;
+    }
+    // a lookup of an absent label stops at the first empty bucket
+    if (used > num_elements || used == capacity) {
+      throw std::runtime_error("possible index file corruption, label index holds more entries than elements");
+    }
+    for (size_t b = 0; check_labels && b < capacity; ++b) {
+      if (buckets_[b] == kNotFound) {
+        continue;
+      }
+      // the probe of the label must reach b without an empty bucket or another entry of the same label
+      label_t label = get_label(buckets_[b]);
+      for (size_t p = Hash(label) & mask_; p != b; p = (p + 1) & mask_) {
+        if (buckets_[p] == kNotFound || get_label(buckets_[p]) == label) {
+          throw std::runtime_error("possible index file corruption, label index entry does not match its label");
+        }
+      }
+    }
+  }
+
+private:
+  // splitmix64 finalizer, sequential labels spread over the whole table
+  static inline __attribute__((always_inline)) auto Hash(label_t label) -> size_t
+  {
+    uint64_t x = label;
+    x          = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x          = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  std::vector<tableint>  buckets_;
+  size_t                 mask_{0};
+  DistributedSharedMutex lock_{};
+};
+
+}  // namespace wowlib
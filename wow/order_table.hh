@@ -2,6 +2,10 @@
 
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <optional>
+#include <limits>
 #include <random>
 #include <unordered_set>
 #include "ygg/ygg.hpp"
@@ -31,25 +35,42 @@ class OrderTable
 public:
   OrderTable() = default;
 
-  ~OrderTable() = default;
+  virtual ~OrderTable() = default;
 
   virtual void InsertAttInid(const att_label_t<att_t>& att_label, tableint id) = 0;
 
+  // removes the key inserted for id, used by deletion
+  virtual void RemoveAttInid(const att_label_t<att_t> &att_label, tableint id) = 0;
+
   virtual auto GetWindowedFilterAndEntries(
-      const att_label_t<att_t> &cur_att_label, int half_window_size, std::vector<tableint> &entry_points) -> wow_range<att_label_t<att_t>> = 0;
+      const att_label_t<att_t> &cur_att_label, size_t half_window_size, std::vector<tableint> &entry_points) -> wow_range<att_label_t<att_t>> = 0;
 
   virtual auto GetInWindowCandidates(const std::vector<dist_id_pair> &candidates,
-      const std::vector<att_label_t<att_t>> &cand_att_label_vec, const att_label_t<att_t> &center_att_label, int half_window_size)
+      const std::vector<att_label_t<att_t>> &cand_att_label_vec, const att_label_t<att_t> &center_att_label, size_t half_window_size)
       -> std::vector<dist_id_pair> = 0;
 
   virtual auto GetRangeCardinality(const att_label_t<att_t> &l, const att_label_t<att_t> &u, std::vector<tableint> &OUT_eps) -> size_t = 0;
 
-  virtual void Serialize(std::ostream &os) { std::cout << "Serialize is not implemented" << std::endl; };
+  // appends the ids of the keys in [l, u] in key order, at most limit of them
+  virtual void GetRangeIds(const att_label_t<att_t> &l, const att_label_t<att_t> &u, std::vector<tableint> &OUT_ids,
+      size_t limit = std::numeric_limits<size_t>::max()) = 0;
+
+  virtual auto Size() -> size_t = 0;
+
+  // ids of all elements in key order
+  virtual void GetOrderedIds(std::vector<tableint> &OUT_ids) = 0;
 
-  virtual void Deserialize(std::istream &is) { std::cout << "Deserialize is not implemented" << std::endl; };
+  // writes the element count followed by (id, label) of every element in key order
+  virtual void Serialize(std::ostream &os) = 0;
+
+  // restores the order written by Serialize, get_att maps an id to the attribute stored in the index. every id must be
+  // one of the num_elements elements of the index and appear once
+  virtual void Deserialize(
+      std::istream &is, size_t num_elements, const std::function<const att_t &(tableint)> &get_att) = 0;
 
 protected:
-  std::mutex lock_{};
+  // lookups take it shared, only InsertAttInid, RemoveAttInid and Deserialize take it exclusive
+  DistributedSharedMutex lock_{};
   // std::unordered_set<att_t> unique_lookup_;
 };
 
@@ -77,16 +98,25 @@ class WBTreeOrderTable : public OrderTable<att_t>
     tableint id_;
   };
 
-  using MyTree = ygg::WBTree<WBNode, ygg::WBDefaultNodeTraits, MyTreeOptions>;
+  class MyTree : public ygg::WBTree<WBNode, ygg::WBDefaultNodeTraits, MyTreeOptions>
+  {
+  public:
+    // replace the content by a prebuilt tree with valid parent links and _wbt_size
+    void AssignBuilt(WBNode *root, size_t n)
+    {
+      this->root = root;
+      this->s.set(n);
+    }
+  };
 
 public:
   WBTreeOrderTable() = delete;
 
-  explicit WBTreeOrderTable(size_t max_N) : max_N_(max_N) { node_store_ = new WBNode *[max_N]; }
+  explicit WBTreeOrderTable(size_t max_N) : max_N_(max_N) { node_store_ = new WBNode *[max_N](); }
 
   virtual ~WBTreeOrderTable()
   {
-    for (int i = 0; i < tree_.size(); ++i) {
+    for (size_t i = 0; i < max_N_; ++i) {
       delete node_store_[i];
     }
     delete[] node_store_;
@@ -94,16 +124,40 @@ public:
 
   void InsertAttInid(const att_label_t<att_t>& att_label, tableint id) override
   {
-    std::lock_guard<std::mutex> lock(this->lock_);
-    auto node                 = new WBNode(att_label, id);
-    node_store_[tree_.size()] = node;
+    // the WBT rebalances along the whole insertion path up to the root, so the tree itself is locked exclusively,
+    // but only for the O(log n) relink, the node is allocated before
+    auto                                     node = new WBNode(att_label, id);
+    std::unique_lock<DistributedSharedMutex> lock(this->lock_);
+    if (node_store_[id] != nullptr) {
+      delete node;
+      throw std::runtime_error("internal id is already in the order table");
+    }
+    node_store_[id] = node;
     tree_.insert(*node);
   }
 
+  void RemoveAttInid(const att_label_t<att_t> &att_label, tableint id) override
+  {
+    WBNode *node;
+    {
+      std::unique_lock<DistributedSharedMutex> lock(this->lock_);
+      node = node_store_[id];
+      if (node == nullptr || node->att_label_ != att_label) {
+        throw std::runtime_error("Current node not found");
+      }
+      tree_.remove(*node);
+      node_store_[id] = nullptr;
+    }
+    delete node;
+  }
+
   auto GetWindowedFilterAndEntries(
-      const att_label_t<att_t> &cur_att_label, int half_window_size, std::vector<tableint> &entry_points) -> wow_range<att_label_t<att_t>> override
+      const att_label_t<att_t> &cur_att_label, size_t half_window_size, std::vector<tableint> &entry_points) -> wow_range<att_label_t<att_t>> override
   {
-    std::lock_guard<std::mutex> lock(this->lock_);
+    std::shared_lock<DistributedSharedMutex> lock(this->lock_);
+    if (tree_.size() == 0) {
+      throw std::runtime_error("order table is empty");
+    }
     // if pos_l == 0 and pos_u == order_.size() - 1, the filter is the whole range just return
     if (2 * half_window_size >= tree_.size()) {
       entry_points.emplace_back(tree_.begin()->id_);
@@ -121,29 +175,29 @@ public:
   }
 
   auto GetInWindowCandidates(const std::vector<dist_id_pair> &candidates,
-      const std::vector<att_label_t<att_t>> &cand_att_label_vec, const att_label_t<att_t> &center_att_label, int half_window_size)
+      const std::vector<att_label_t<att_t>> &cand_att_label_vec, const att_label_t<att_t> &center_att_label, size_t half_window_size)
       -> std::vector<dist_id_pair> override
   {
-    std::lock_guard<std::mutex> lock(this->lock_);
-    std::vector<dist_id_pair>   in_window_ids;
-    // get the out of window id
-    if (2 * half_window_size >= tree_.size()) {
-      for (auto &c : candidates) {
-        in_window_ids.emplace_back(c);
+    std::vector<dist_id_pair> in_window_ids;
+    // the boundary keys reference attributes stored in the index, so the filtering below runs unlocked
+    std::optional<att_label_t<att_t>> l_att_label, u_att_label;
+    {
+      std::shared_lock<DistributedSharedMutex> lock(this->lock_);
+      // get the out of window id
+      if (2 * half_window_size >= tree_.size()) {
+        return candidates;
       }
-      return in_window_ids;
+      // a deleted center is no longer in the tree, its window is taken around where it would be
+      auto    it            = tree_.lower_bound(WBNode(center_att_label, -1));
+      WBNode *cur_node      = it == tree_.end() ? &*tree_.rbegin() : &*it;
+      auto    boundary_node = GetWindowRangeLabel(cur_node, half_window_size);
+      l_att_label.emplace(boundary_node.l_->att_label_);
+      u_att_label.emplace(boundary_node.u_->att_label_);
     }
-    auto it = tree_.find(WBNode(center_att_label, -1));
-    if (it == tree_.end()) {
-      throw std::runtime_error("Current node not found");
-    }
-    auto boundary_node = GetWindowRangeLabel(&*it, half_window_size);
-    for (int i = 0; i < candidates.size(); ++i) {
-      auto &c     = candidates[i];
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      auto &c           = candidates[i];
       auto &c_att_label = cand_att_label_vec[i];
-      auto  &l_att_label = boundary_node.l_->att_label_;
-      auto  &u_att_label = boundary_node.u_->att_label_;
-      if (c_att_label >= l_att_label && c_att_label <= u_att_label) {
+      if (c_att_label >= *l_att_label && c_att_label <= *u_att_label) {
         in_window_ids.emplace_back(c);
       }
     }
@@ -212,13 +266,20 @@ public:
 
   auto GetRangeCardinality(const att_label_t<att_t> &l, const att_label_t<att_t> &u, std::vector<tableint> &OUT_eps) -> size_t override
   {
-    std::lock_guard<std::mutex> lock(this->lock_);
+    std::shared_lock<DistributedSharedMutex> lock(this->lock_);
+    // an empty range has no key >= l, no key <= u or lies between two keys
+    if (tree_.size() == 0 || tree_.rbegin()->att_label_ < l || tree_.begin()->att_label_ > u) {
+      return 0;
+    }
     // TODO: merge find bound and getnode index functions
     WBNode *root   = tree_.get_root();
     WBNode *node_l = FindUpperBound(root, l);
     WBNode *node_u = FindLowerBound(root, u);
-    size_t  i      = GetNodeIndex(root, node_l->att_label_);
-    size_t  j      = GetNodeIndex(root, node_u->att_label_);
+    if (node_u->att_label_ < node_l->att_label_) {
+      return 0;
+    }
+    size_t i = GetNodeIndex(root, node_l->att_label_);
+    size_t j = GetNodeIndex(root, node_u->att_label_);
     OUT_eps.emplace_back(node_l->id_);
     if (node_l != node_u) {
       OUT_eps.emplace_back(node_u->id_);
@@ -226,10 +287,89 @@ public:
     return j - i + 1;
   }
 
+  void GetRangeIds(const att_label_t<att_t> &l, const att_label_t<att_t> &u, std::vector<tableint> &OUT_ids,
+      size_t limit = std::numeric_limits<size_t>::max()) override
+  {
+    std::shared_lock<DistributedSharedMutex> lock(this->lock_);
+    for (auto it = tree_.lower_bound(WBNode(l, -1)); it != tree_.end() && it->att_label_ <= u && limit > 0; ++it) {
+      OUT_ids.emplace_back(it->id_);
+      limit--;
+    }
+  }
+
+  auto Size() -> size_t override
+  {
+    std::shared_lock<DistributedSharedMutex> lock(this->lock_);
+    return tree_.size();
+  }
+
+  void GetOrderedIds(std::vector<tableint> &OUT_ids) override
+  {
+    std::shared_lock<DistributedSharedMutex> lock(this->lock_);
+    OUT_ids.clear();
+    OUT_ids.reserve(tree_.size());
+    for (auto it = tree_.begin(); it != tree_.end(); ++it) {
+      OUT_ids.emplace_back(it->id_);
+    }
+  }
+
+  void Serialize(std::ostream &os) override
+  {
+    std::shared_lock<DistributedSharedMutex> lock(this->lock_);
+    size_t                                   n = tree_.size();
+    WriteBinaryPOD(os, n);
+    for (auto it = tree_.begin(); it != tree_.end(); ++it) {
+      WriteBinaryPOD(os, it->id_);
+      WriteBinaryPOD(os, it->att_label_.label_);
+    }
+  }
+
+  void Deserialize(
+      std::istream &is, size_t num_elements, const std::function<const att_t &(tableint)> &get_att) override
+  {
+    std::unique_lock<DistributedSharedMutex> lock(this->lock_);
+    if (tree_.size() != 0) {
+      throw std::runtime_error("order table must be empty before deserialization");
+    }
+    size_t n;
+    ReadBinaryPOD(is, n);
+    if (n > num_elements || num_elements > max_N_) {
+      throw std::runtime_error("possible index file corruption, order table is larger than the index");
+    }
+    // nodes are already in key order, so a perfectly balanced tree is built bottom-up in O(n)
+    std::vector<WBNode *> ranked(n);
+    for (size_t i = 0; i < n; ++i) {
+      tableint id;
+      label_t  label;
+      ReadBinaryPOD(is, id);
+      ReadBinaryPOD(is, label);
+      if (id >= num_elements || node_store_[id] != nullptr) {
+        throw std::runtime_error("possible index file corruption, invalid id in the order table");
+      }
+      ranked[i] = node_store_[id] = new WBNode(att_label_t<att_t>(get_att(id), label), id);
+    }
+    tree_.AssignBuilt(BuildBalanced(ranked, 0, n, nullptr), n);
+  }
+
 private:
+  // link ranked[lo, hi) into a perfectly balanced subtree and return its root
+  auto BuildBalanced(const std::vector<WBNode *> &ranked, size_t lo, size_t hi, WBNode *parent) -> WBNode *
+  {
+    if (lo >= hi) {
+      return nullptr;
+    }
+    size_t  mid  = lo + (hi - lo) / 2;
+    WBNode *node = ranked[mid];
+    node->set_parent(parent);
+    node->set_left(BuildBalanced(ranked, lo, mid, node));
+    node->set_right(BuildBalanced(ranked, mid + 1, hi, node));
+    node->_wbt_size = hi - lo + 1;
+    return node;
+  }
+
   auto GetKthSmallestNode(WBNode *root, int k) -> WBNode *
   {
-    if (root == nullptr || k <= 0 || k > root->_wbt_size - 1) {
+    if (root == nullptr || k <= 0 || k > (int)root->_wbt_size - 1) {
       return nullptr;
     }
 
@@ -251,7 +391,7 @@ private:
   }
   auto GetKthLargestNode(WBNode *root, int k) -> WBNode *
   {
-    if (root == nullptr || k <= 0 || k > root->_wbt_size - 1) {
+    if (root == nullptr || k <= 0 || k > (int)root->_wbt_size - 1) {
       return nullptr;
     }
 
@@ -294,7 +434,7 @@ private:
           break;
         }
         if (current == parent->get_right()) {
-          if ((parent->get_left() ? parent->get_left()->_wbt_size - 1 : 0) + 1 >= k) {
+          if ((parent->get_left() ? (int)parent->get_left()->_wbt_size - 1 : 0) + 1 >= k) {
             if (k == 1) {
               boundary_node.l_ = parent;
               break;
@@ -328,7 +468,7 @@ private:
           break;
         }
         if (current == parent->get_left()) {
-          if ((parent->get_right() ? parent->get_right()->_wbt_size - 1 : 0) + 1 >= k) {
+          if ((parent->get_right() ? (int)parent->get_right()->_wbt_size - 1 : 0) + 1 >= k) {
             if (k == 1) {
               boundary_node.u_ = parent;
               break;
@@ -369,4 +509,228 @@ public:
   WBNode **node_store_;
 };
 
+/**
+ * @brief immutable order table for frozen indexes
+ *
+ * keys are copied into flat arrays: one in key order (rank -> key, id) and one in Eytzinger (BFS) order used by
+ * the bound searches, which are branch free and prefetch friendly. no operation takes a lock.
+ */
+template <typename att_t>
+class StaticOrderTable : public OrderTable<att_t>
+{
+  struct Key
+  {
+    att_t   att_;
+    label_t label_;
+  };
+
+public:
+  StaticOrderTable() = delete;
+
+  explicit StaticOrderTable(size_t max_N) : max_N_(max_N) {}
+
+  // ids must be in key order, get_att/get_label read the stored element
+  StaticOrderTable(size_t max_N, const std::vector<tableint> &ordered_ids,
+      const std::function<const att_t &(tableint)> &get_att, const std::function<label_t(tableint)> &get_label)
+      : max_N_(max_N)
+  {
+    ids_ = ordered_ids;
+    keys_.resize(ids_.size());
+    for (size_t i = 0; i < ids_.size(); ++i) {
+      keys_[i] = {get_att(ids_[i]), get_label(ids_[i])};
+    }
+    BuildEytzinger();
+  }
+
+  void InsertAttInid(const att_label_t<att_t> & /*att_label*/, tableint /*id*/) override
+  {
+    throw std::runtime_error("order table is frozen, inserts are not allowed");
+  }
+
+  void RemoveAttInid(const att_label_t<att_t> & /*att_label*/, tableint /*id*/) override
+  {
+    throw std::runtime_error("order table is frozen, deletes are not allowed");
+  }
+
+  auto GetWindowedFilterAndEntries(const att_label_t<att_t> &cur_att_label, size_t half_window_size,
+      std::vector<tableint> &entry_points) -> wow_range<att_label_t<att_t>> override
+  {
+    size_t n = ids_.size();
+    if (n == 0) {
+      throw std::runtime_error("order table is empty");
+    }
+    if (2 * half_window_size >= n) {
+      entry_points.emplace_back(ids_[0]);
+      return {KeyAt(0), KeyAt(n - 1)};
+    }
+    size_t pos = std::min(LowerBound(cur_att_label), n - 1);
+    size_t l   = pos >= half_window_size ? pos - half_window_size : 0;
+    size_t u   = std::min(pos + half_window_size, n - 1);
+    entry_points.emplace_back(ids_[l]);
+    if (l != u) {
+      entry_points.emplace_back(ids_[u]);
+    }
+    return {KeyAt(l), KeyAt(u)};
+  }
+
+  auto GetInWindowCandidates(const std::vector<dist_id_pair> &candidates,
+      const std::vector<att_label_t<att_t>> &cand_att_label_vec, const att_label_t<att_t> &center_att_label,
+      size_t half_window_size) -> std::vector<dist_id_pair> override
+  {
+    size_t n = ids_.size();
+    if (2 * half_window_size >= n) {
+      return candidates;
+    }
+    size_t pos = LowerBound(center_att_label);
+    if (pos == n || !(KeyAt(pos) == center_att_label)) {
+      throw std::runtime_error("Current node not found");
+    }
+    auto                      l_att_label = KeyAt(pos >= half_window_size ? pos - half_window_size : 0);
+    auto                      u_att_label = KeyAt(std::min(pos + half_window_size, n - 1));
+    std::vector<dist_id_pair> in_window_ids;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      if (cand_att_label_vec[i] >= l_att_label && cand_att_label_vec[i] <= u_att_label) {
+        in_window_ids.emplace_back(candidates[i]);
+      }
+    }
+    return in_window_ids;
+  }
+
+  auto GetRangeCardinality(const att_label_t<att_t> &l, const att_label_t<att_t> &u, std::vector<tableint> &OUT_eps)
+      -> size_t override
+  {
+    size_t i = LowerBound(l);
+    size_t j = UpperBound(u);  // one past the last key <= u
+    if (i >= j) {
+      return 0;
+    }
+    OUT_eps.emplace_back(ids_[i]);
+    if (i != j - 1) {
+      OUT_eps.emplace_back(ids_[j - 1]);
+    }
+    return j - i;
+  }
+
+  void GetRangeIds(const att_label_t<att_t> &l, const att_label_t<att_t> &u, std::vector<tableint> &OUT_ids,
+      size_t limit = std::numeric_limits<size_t>::max()) override
+  {
+    auto [first, last] = GetRankRange(l, u);
+    last               = first + std::min(limit, last - first);
+    OUT_ids.insert(OUT_ids.end(), ids_.begin() + first, ids_.begin() + last);
+  }
+
+  // ranks [first, last) of the keys in [l, u]
+  auto GetRankRange(const att_label_t<att_t> &l, const att_label_t<att_t> &u) const -> std::pair<size_t, size_t>
+  {
+    size_t i = LowerBound(l);
+    return {i, std::max(i, UpperBound(u))};
+  }
+
+  auto Size() -> size_t override { return ids_.size(); }
+
+  void GetOrderedIds(std::vector<tableint> &OUT_ids) override { OUT_ids = ids_; }
+
+  void Serialize(std::ostream &os) override
+  {
+    size_t n = ids_.size();
+    WriteBinaryPOD(os, n);
+    for (size_t i = 0; i < n; ++i) {
+      WriteBinaryPOD(os, ids_[i]);
+      WriteBinaryPOD(os, keys_[i].label_);
+    }
+  }
+
+  void Deserialize(
+      std::istream &is, size_t num_elements, const std::function<const att_t &(tableint)> &get_att) override
+  {
+    size_t n;
+    ReadBinaryPOD(is, n);
+    if (n > num_elements || num_elements > max_N_) {
+      throw std::runtime_error("possible index file corruption, order table is larger than the index");
+    }
+    ids_.resize(n);
+    keys_.resize(n);
+    std::vector<bool> seen(num_elements, false);
+    for (size_t i = 0; i < n; ++i) {
+      ReadBinaryPOD(is, ids_[i]);
+      ReadBinaryPOD(is, keys_[i].label_);
+      if (ids_[i] >= num_elements || seen[ids_[i]]) {
+        throw std::runtime_error("possible index file corruption, invalid id in the order table");
+      }
+      seen[ids_[i]] = true;
+      keys_[i].att_ = get_att(ids_[i]);
+    }
+    BuildEytzinger();
+  }
+
+private:
+  inline __attribute__((always_inline)) auto KeyAt(size_t rank) const -> att_label_t<att_t>
+  {
+    return {keys_[rank].att_, keys_[rank].label_};
+  }
+
+  static inline __attribute__((always_inline)) bool Less(const Key &a, const att_label_t<att_t> &b)
+  {
+    return a.att_ < b.att_ || (a.att_ == b.att_ && a.label_ < b.label_);
+  }
+
+  static inline __attribute__((always_inline)) bool Greater(const Key &a, const att_label_t<att_t> &b)
+  {
+    return a.att_ > b.att_ || (a.att_ == b.att_ && a.label_ > b.label_);
+  }
+
+  // rank of the first key >= t, n if none
+  auto LowerBound(const att_label_t<att_t> &t) const -> size_t
+  {
+    size_t k = 1, n = ids_.size();
+    while (k <= n) {
+      __builtin_prefetch(eyt_keys_.data() + std::min(16 * k, n));
+      k = 2 * k + Less(eyt_keys_[k], t);
+    }
+    k >>= __builtin_ffsll(~k);
+    return k == 0 ? n : eyt_rank_[k];
+  }
+
+  // rank of the first key > t, n if none
+  auto UpperBound(const att_label_t<att_t> &t) const -> size_t
+  {
+    size_t k = 1, n = ids_.size();
+    while (k <= n) {
+      __builtin_prefetch(eyt_keys_.data() + std::min(16 * k, n));
+      k = 2 * k + !Greater(eyt_keys_[k], t);
+    }
+    k >>= __builtin_ffsll(~k);
+    return k == 0 ? n : eyt_rank_[k];
+  }
+
+  void BuildEytzinger()
+  {
+    eyt_keys_.resize(ids_.size() + 1);
+    eyt_rank_.resize(ids_.size() + 1);
+    size_t rank = 0;
+    FillEytzinger(1, rank);
+  }
+
+  // in-order walk of the implicit tree assigns sorted keys to BFS slots, slot 0 is unused
+  void FillEytzinger(size_t k, size_t &rank)
+  {
+    if (k > ids_.size()) {
+      return;
+    }
+    FillEytzinger(2 * k, rank);
+    eyt_keys_[k] = keys_[rank];
+    eyt_rank_[k] = rank++;
+    FillEytzinger(2 * k + 1, rank);
+  }
+
+public:
+  size_t max_N_{};
+
+private:
+  std::vector<tableint> ids_;
+  std::vector<Key>      keys_;
+  std::vector<Key>      eyt_keys_;
+  std::vector<size_t>   eyt_rank_;
+};
+
 }  // namespace wowlib
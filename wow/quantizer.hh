@@ -0,0 +1,553 @@
+#pragma once
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <limits>
+#include <stdexcept>
+#include "disk.hh"
+#include "space_dist.hh"
+
+namespace wowlib {
+
+/**
+ * @brief compresses vectors into fixed size codes that graph traversal reads instead of the full vectors
+ *
+ * a query is first turned into a quantizer specific buffer by PrepareQuery, which is then compared against codes
+ * with GetQueryDistFunc(): dist(query buffer, code, GetQueryDistFuncParam()), the same signature as DISTFUNC.
+ */
+class QuantizerInterface
+{
+public:
+  virtual ~QuantizerInterface() = default;
+
+  virtual auto GetName() const -> std::string = 0;
+  virtual auto GetCodeSize() const -> size_t = 0;
+  virtual auto GetQueryBufSize() const -> size_t = 0;
+
+  // n row-major vectors of the quantizer dimension
+  virtual void Train(const float *data, size_t n) = 0;
+  virtual void Encode(const float *vec, uint8_t *OUT_code) const = 0;
+  virtual void PrepareQuery(const float *query, char *OUT_buf) const = 0;
+
+  virtual auto GetQueryDistFunc() const -> DISTFUNC<float> = 0;
+  virtual auto GetQueryDistFuncParam() const -> const void * = 0;
+
+  virtual void Serialize(std::ostream &os) const = 0;
+  virtual void Deserialize(std::istream &is) = 0;
+};
+
+struct SQ8DistParam
+{
+  size_t       dim_;
+  const float *scale_;
+};
+
+// query buffer: q - min. dist = sum (q_i - min_i - c_i * scale_i)^2
+static float SQ8L2Sqr(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto        param = (const SQ8DistParam *)param_ptr;
+  auto        q     = (const float *)qbuf;
+  auto        c     = (const uint8_t *)code;
+  const float *s    = param->scale_;
+  float        res  = 0;
+  for (size_t i = 0; i < param->dim_; ++i) {
+    float t = q[i] - c[i] * s[i];
+    res += t * t;
+  }
+  return res;
+}
+
+// query buffer: w_i = q_i * scale_i followed by bias = sum q_i * min_i. dist = 1 - bias - sum w_i * c_i
+static float SQ8InnerProductDistance(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto  param = (const SQ8DistParam *)param_ptr;
+  auto  w     = (const float *)qbuf;
+  auto  c     = (const uint8_t *)code;
+  float res   = 0;
+  for (size_t i = 0; i < param->dim_; ++i) {
+    res += w[i] * c[i];
+  }
+  return 1.0f - w[param->dim_] - res;
+}
+
+#if defined(USE_AVX512)
+
+static float SQ8L2SqrAVX512(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto         param = (const SQ8DistParam *)param_ptr;
+  auto         q     = (const float *)qbuf;
+  auto         c     = (const uint8_t *)code;
+  const float *s     = param->scale_;
+  size_t       d     = param->dim_;
+  size_t       i     = 0;
+  __m512       sum   = _mm512_setzero_ps();
+  for (; i + 16 <= d; i += 16) {
+    __m512 cv   = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(c + i))));
+    __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(q + i), _mm512_mul_ps(cv, _mm512_loadu_ps(s + i)));
+    sum         = _mm512_fmadd_ps(diff, diff, sum);
+  }
+  float res = _mm512_reduce_add_ps(sum);
+  for (; i < d; ++i) {
+    float t = q[i] - c[i] * s[i];
+    res += t * t;
+  }
+  return res;
+}
+
+static float SQ8InnerProductDistanceAVX512(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto   param = (const SQ8DistParam *)param_ptr;
+  auto   w     = (const float *)qbuf;
+  auto   c     = (const uint8_t *)code;
+  size_t d     = param->dim_;
+  size_t i     = 0;
+  __m512 sum   = _mm512_setzero_ps();
+  for (; i + 16 <= d; i += 16) {
+    __m512 cv = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(c + i))));
+    sum       = _mm512_fmadd_ps(cv, _mm512_loadu_ps(w + i), sum);
+  }
+  float res = _mm512_reduce_add_ps(sum);
+  for (; i < d; ++i) {
+    res += w[i] * c[i];
+  }
+  return 1.0f - w[d] - res;
+}
+
+#endif
+
+#if defined(__AVX2__)
+
+static inline float SQ8ReduceAdd256(__m256 v)
+{
+  __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  lo        = _mm_hadd_ps(lo, lo);
+  lo        = _mm_hadd_ps(lo, lo);
+  return _mm_cvtss_f32(lo);
+}
+
+static float SQ8L2SqrAVX2(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto         param = (const SQ8DistParam *)param_ptr;
+  auto         q     = (const float *)qbuf;
+  auto         c     = (const uint8_t *)code;
+  const float *s     = param->scale_;
+  size_t       d     = param->dim_;
+  size_t       i     = 0;
+  __m256       sum   = _mm256_setzero_ps();
+  for (; i + 8 <= d; i += 8) {
+    __m256 cv   = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(c + i))));
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(q + i), _mm256_mul_ps(cv, _mm256_loadu_ps(s + i)));
+    sum         = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+  }
+  float res = SQ8ReduceAdd256(sum);
+  for (; i < d; ++i) {
+    float t = q[i] - c[i] * s[i];
+    res += t * t;
+  }
+  return res;
+}
+
+static float SQ8InnerProductDistanceAVX2(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto   param = (const SQ8DistParam *)param_ptr;
+  auto   w     = (const float *)qbuf;
+  auto   c     = (const uint8_t *)code;
+  size_t d     = param->dim_;
+  size_t i     = 0;
+  __m256 sum   = _mm256_setzero_ps();
+  for (; i + 8 <= d; i += 8) {
+    __m256 cv = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(c + i))));
+    sum       = _mm256_add_ps(sum, _mm256_mul_ps(cv, _mm256_loadu_ps(w + i)));
+  }
+  float res = SQ8ReduceAdd256(sum);
+  for (; i < d; ++i) {
+    res += w[i] * c[i];
+  }
+  return 1.0f - w[d] - res;
+}
+
+#endif
+
+/**
+ * @brief 8-bit scalar quantizer, one byte per dimension with a per-dimension [min, max] learned by Train
+ */
+class SQ8Quantizer : public QuantizerInterface
+{
+public:
+  SQ8Quantizer(size_t dim, bool is_ip) : dim_(dim), is_ip_(is_ip), min_(dim, 0), scale_(dim, 0)
+  {
+    param_ = {dim_, scale_.data()};
+    if (is_ip_) {
+      distfunc_ = SQ8InnerProductDistance;
+#if defined(USE_AVX512)
+      if (AVX512Capable()) {
+        distfunc_ = SQ8InnerProductDistanceAVX512;
+      } else
+#endif
+      {
+#if defined(__AVX2__)
+        distfunc_ = SQ8InnerProductDistanceAVX2;
+#endif
+      }
+    } else {
+      distfunc_ = SQ8L2Sqr;
+#if defined(USE_AVX512)
+      if (AVX512Capable()) {
+        distfunc_ = SQ8L2SqrAVX512;
+      } else
+#endif
+      {
+#if defined(__AVX2__)
+        distfunc_ = SQ8L2SqrAVX2;
+#endif
+      }
+    }
+  }
+
+  auto GetName() const -> std::string override { return "sq8"; }
+  auto GetCodeSize() const -> size_t override { return dim_; }
+  auto GetQueryBufSize() const -> size_t override { return (dim_ + 1) * sizeof(float); }
+
+  void Train(const float *data, size_t n) override
+  {
+    if (n == 0) {
+      throw std::runtime_error("SQ8Quantizer: no training vectors");
+    }
+    std::vector<float> max(data, data + dim_);
+    std::copy(data, data + dim_, min_.begin());
+    for (size_t i = 1; i < n; ++i) {
+      auto v = data + i * dim_;
+      for (size_t j = 0; j < dim_; ++j) {
+        min_[j] = std::min(min_[j], v[j]);
+        max[j]  = std::max(max[j], v[j]);
+      }
+    }
+    for (size_t j = 0; j < dim_; ++j) {
+      scale_[j] = (max[j] - min_[j]) / 255.0f;
+    }
+  }
+
+  void Encode(const float *vec, uint8_t *OUT_code) const override
+  {
+    for (size_t j = 0; j < dim_; ++j) {
+      if (scale_[j] == 0) {
+        OUT_code[j] = 0;
+        continue;
+      }
+      float c     = std::round((vec[j] - min_[j]) / scale_[j]);
+      OUT_code[j] = (uint8_t)std::clamp(c, 0.0f, 255.0f);
+    }
+  }
+
+  void PrepareQuery(const float *query, char *OUT_buf) const override
+  {
+    auto buf = (float *)OUT_buf;
+    if (is_ip_) {
+      float bias = 0;
+      for (size_t j = 0; j < dim_; ++j) {
+        buf[j] = query[j] * scale_[j];
+        bias += query[j] * min_[j];
+      }
+      buf[dim_] = bias;
+    } else {
+      for (size_t j = 0; j < dim_; ++j) {
+        buf[j] = query[j] - min_[j];
+      }
+    }
+  }
+
+  auto GetQueryDistFunc() const -> DISTFUNC<float> override { return distfunc_; }
+  auto GetQueryDistFuncParam() const -> const void * override { return &param_; }
+
+  void Serialize(std::ostream &os) const override
+  {
+    WriteBinaryPOD(os, dim_);
+    os.write((const char *)min_.data(), dim_ * sizeof(float));
+    os.write((const char *)scale_.data(), dim_ * sizeof(float));
+  }
+
+  void Deserialize(std::istream &is) override
+  {
+    size_t dim;
+    ReadBinaryPOD(is, dim);
+    if (dim != dim_) {
+      throw std::runtime_error("SQ8Quantizer: dimension mismatch");
+    }
+    is.read((char *)min_.data(), dim_ * sizeof(float));
+    is.read((char *)scale_.data(), dim_ * sizeof(float));
+  }
+
+private:
+  size_t             dim_;
+  bool               is_ip_;
+  std::vector<float> min_;
+  std::vector<float> scale_;
+  SQ8DistParam       param_;
+  DISTFUNC<float>    distfunc_{nullptr};
+};
+
+struct PQDistParam
+{
+  size_t m_;
+};
+
+// query buffer: m lookup tables of 256 entries followed by a bias. dist = bias + sum_j lut_j[code_j]
+static float PQAdc(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto  m   = ((const PQDistParam *)param_ptr)->m_;
+  auto  lut = (const float *)qbuf;
+  auto  c   = (const uint8_t *)code;
+  float res = lut[m * 256];
+  for (size_t j = 0; j < m; ++j) {
+    res += lut[j * 256 + c[j]];
+  }
+  return res;
+}
+
+#if defined(USE_AVX512)
+
+static float PQAdcAVX512(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto    m    = ((const PQDistParam *)param_ptr)->m_;
+  auto    lut  = (const float *)qbuf;
+  auto    c    = (const uint8_t *)code;
+  __m512i offs = _mm512_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792, 2048, 2304, 2560, 2816, 3072, 3328,
+      3584, 3840);
+  __m512  sum  = _mm512_setzero_ps();
+  size_t  j    = 0;
+  for (; j + 16 <= m; j += 16) {
+    __m512i idx = _mm512_add_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(c + j))), offs);
+    sum         = _mm512_add_ps(sum, _mm512_i32gather_ps(idx, lut + j * 256, 4));
+  }
+  float res = lut[m * 256] + _mm512_reduce_add_ps(sum);
+  for (; j < m; ++j) {
+    res += lut[j * 256 + c[j]];
+  }
+  return res;
+}
+
+#endif
+
+#if defined(__AVX2__)
+
+static float PQAdcAVX2(const void *qbuf, const void *code, const void *param_ptr)
+{
+  auto    m    = ((const PQDistParam *)param_ptr)->m_;
+  auto    lut  = (const float *)qbuf;
+  auto    c    = (const uint8_t *)code;
+  __m256i offs = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+  __m256  sum  = _mm256_setzero_ps();
+  size_t  j    = 0;
+  for (; j + 8 <= m; j += 8) {
+    __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(c + j))), offs);
+    sum         = _mm256_add_ps(sum, _mm256_i32gather_ps(lut + j * 256, idx, 4));
+  }
+  float res = lut[m * 256] + SQ8ReduceAdd256(sum);
+  for (; j < m; ++j) {
+    res += lut[j * 256 + c[j]];
+  }
+  return res;
+}
+
+#endif
+
+/**
+ * @brief product quantizer with m sub-quantizers of 256 centroids each, one byte per sub-quantizer
+ *
+ * sub-quantizer j covers dimensions [j * dim / m, (j + 1) * dim / m), so m does not need to divide dim.
+ * codebooks are trained with k-means on at most kMaxTrainPerCentroid * 256 vectors. searches compare a query
+ * against codes with per-query lookup tables (asymmetric distance computation).
+ */
+class PQQuantizer : public QuantizerInterface
+{
+public:
+  static constexpr size_t kCentroids           = 256;
+  static constexpr size_t kMaxTrainPerCentroid = 64;
+  static constexpr size_t kKMeansIterations    = 25;
+
+  PQQuantizer(size_t dim, size_t m, bool is_ip) : dim_(dim), m_(m), is_ip_(is_ip), centroids_(kCentroids * dim)
+  {
+    if (m_ == 0 || m_ > dim_) {
+      throw std::runtime_error("PQQuantizer: number of sub-quantizers must be in [1, dim]");
+    }
+    for (size_t j = 0; j <= m_; ++j) {
+      sub_offset_.emplace_back(j * dim_ / m_);
+    }
+    param_    = {m_};
+    distfunc_ = PQAdc;
+#if defined(USE_AVX512)
+    if (AVX512Capable()) {
+      distfunc_ = PQAdcAVX512;
+    } else
+#endif
+    {
+#if defined(__AVX2__)
+      distfunc_ = PQAdcAVX2;
+#endif
+    }
+  }
+
+  auto GetName() const -> std::string override { return "pq" + std::to_string(m_); }
+  auto GetCodeSize() const -> size_t override { return m_; }
+  auto GetQueryBufSize() const -> size_t override { return (m_ * kCentroids + 1) * sizeof(float); }
+
+  void Train(const float *data, size_t n) override
+  {
+    if (n == 0) {
+      throw std::runtime_error("PQQuantizer: no training vectors");
+    }
+    std::mt19937        rng(1234);
+    std::vector<size_t> sample(n);
+    for (size_t i = 0; i < n; ++i) {
+      sample[i] = i;
+    }
+    std::shuffle(sample.begin(), sample.end(), rng);
+    sample.resize(std::min(n, kCentroids * kMaxTrainPerCentroid));
+    for (size_t j = 0; j < m_; ++j) {
+      size_t             dsub = sub_offset_[j + 1] - sub_offset_[j];
+      std::vector<float> sub(sample.size() * dsub);
+      for (size_t i = 0; i < sample.size(); ++i) {
+        std::copy_n(data + sample[i] * dim_ + sub_offset_[j], dsub, sub.data() + i * dsub);
+      }
+      KMeans(sub.data(), sample.size(), dsub, GetCentroids(j), rng);
+    }
+  }
+
+  void Encode(const float *vec, uint8_t *OUT_code) const override
+  {
+    for (size_t j = 0; j < m_; ++j) {
+      size_t dsub = sub_offset_[j + 1] - sub_offset_[j];
+      OUT_code[j] = (uint8_t)NearestCentroid(vec + sub_offset_[j], GetCentroids(j), kCentroids, dsub);
+    }
+  }
+
+  void PrepareQuery(const float *query, char *OUT_buf) const override
+  {
+    auto lut = (float *)OUT_buf;
+    for (size_t j = 0; j < m_; ++j) {
+      size_t dsub = sub_offset_[j + 1] - sub_offset_[j];
+      auto   q    = query + sub_offset_[j];
+      auto   cent = GetCentroids(j);
+      for (size_t c = 0; c < kCentroids; ++c) {
+        float d = 0;
+        for (size_t t = 0; t < dsub; ++t) {
+          d += is_ip_ ? -q[t] * cent[c * dsub + t] : (q[t] - cent[c * dsub + t]) * (q[t] - cent[c * dsub + t]);
+        }
+        lut[j * kCentroids + c] = d;
+      }
+    }
+    lut[m_ * kCentroids] = is_ip_ ? 1.0f : 0.0f;
+  }
+
+  auto GetQueryDistFunc() const -> DISTFUNC<float> override { return distfunc_; }
+  auto GetQueryDistFuncParam() const -> const void * override { return &param_; }
+
+  void Serialize(std::ostream &os) const override
+  {
+    WriteBinaryPOD(os, dim_);
+    WriteBinaryPOD(os, m_);
+    os.write((const char *)centroids_.data(), centroids_.size() * sizeof(float));
+  }
+
+  void Deserialize(std::istream &is) override
+  {
+    size_t dim, m;
+    ReadBinaryPOD(is, dim);
+    ReadBinaryPOD(is, m);
+    if (dim != dim_ || m != m_) {
+      throw std::runtime_error("PQQuantizer: dimension or sub-quantizer count mismatch");
+    }
+    is.read((char *)centroids_.data(), centroids_.size() * sizeof(float));
+  }
+
+private:
+  // 256 centroids of sub-quantizer j, row-major with its sub-dimension
+  auto GetCentroids(size_t j) -> float * { return centroids_.data() + kCentroids * sub_offset_[j]; }
+  auto GetCentroids(size_t j) const -> const float * { return centroids_.data() + kCentroids * sub_offset_[j]; }
+
+  static auto NearestCentroid(const float *v, const float *cent, size_t k, size_t dsub) -> size_t
+  {
+    size_t best      = 0;
+    float  best_dist = std::numeric_limits<float>::max();
+    for (size_t c = 0; c < k; ++c) {
+      float d = 0;
+      for (size_t t = 0; t < dsub; ++t) {
+        float diff = v[t] - cent[c * dsub + t];
+        d += diff * diff;
+      }
+      if (d < best_dist) {
+        best_dist = d;
+        best      = c;
+      }
+    }
+    return best;
+  }
+
+  // lloyd iterations from random samples, empty clusters are reseeded with a random sample
+  static void KMeans(const float *data, size_t n, size_t dsub, float *OUT_cent, std::mt19937 &rng)
+  {
+    std::vector<size_t> perm(n);
+    for (size_t i = 0; i < n; ++i) {
+      perm[i] = i;
+    }
+    std::shuffle(perm.begin(), perm.end(), rng);
+    for (size_t c = 0; c < kCentroids; ++c) {
+      // fewer samples than centroids: duplicates never win an assignment and are harmless
+      std::copy_n(data + perm[c % n] * dsub, dsub, OUT_cent + c * dsub);
+    }
+    std::vector<size_t> assign(n);
+    std::vector<size_t> count(kCentroids);
+    std::vector<float>  sum(kCentroids * dsub);
+    for (size_t iter = 0; iter < kKMeansIterations; ++iter) {
+#pragma omp parallel for schedule(static)
+      for (size_t i = 0; i < n; ++i) {
+        assign[i] = NearestCentroid(data + i * dsub, OUT_cent, kCentroids, dsub);
+      }
+      std::fill(count.begin(), count.end(), 0);
+      std::fill(sum.begin(), sum.end(), 0.0f);
+      for (size_t i = 0; i < n; ++i) {
+        count[assign[i]]++;
+        for (size_t t = 0; t < dsub; ++t) {
+          sum[assign[i] * dsub + t] += data[i * dsub + t];
+        }
+      }
+      for (size_t c = 0; c < kCentroids; ++c) {
+        if (count[c] == 0) {
+          std::copy_n(data + rng() % n * dsub, dsub, OUT_cent + c * dsub);
+          continue;
+        }
+        for (size_t t = 0; t < dsub; ++t) {
+          OUT_cent[c * dsub + t] = sum[c * dsub + t] / count[c];
+        }
+      }
+    }
+  }
+
+  size_t              dim_;
+  size_t              m_;
+  bool                is_ip_;
+  std::vector<size_t> sub_offset_;
+  std::vector<float>  centroids_;
+  PQDistParam         param_;
+  DISTFUNC<float>     distfunc_{nullptr};
+};
+
+/**
+ * @brief "sq8", or "pq<m>" for a product quantizer with m bytes per code ("pq" alone uses m = dim / 4)
+ */
+static auto CreateQuantizer(const std::string &name, size_t dim, const std::string &space_name)
+    -> QuantizerInterface *
+{
+  if (name == "sq8") {
+    return new SQ8Quantizer(dim, space_name == "ip");
+  }
+  if (name.rfind("pq", 0) == 0) {
+    size_t m = name.size() > 2 ? std::stoul(name.substr(2)) : std::max<size_t>(1, dim / 4);
+    return new PQQuantizer(dim, m, space_name == "ip");
+  }
+  throw std::runtime_error("unsupported quantizer " + name + ", supported: sq8, pq, pq<m>");
+}
+
+}  // namespace wowlib
@@ -0,0 +1,86 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+namespace wowlib {
+
+// how a search is answered, chosen per range search by a QueryPlanner
+enum class SearchPlan : uint8_t
+{
+  kExactScan   = 0,  // score every element of the range, the ids come from the order table
+  kWindowGraph = 1,  // graph search on the layers whose windows match the filter
+  kTopLayer    = 2,  // unfiltered search on the top layer, the filter is applied to its beam
+};
+
+inline auto SearchPlanName(SearchPlan plan) -> const char *
+{
+  switch (plan) {
+    case SearchPlan::kExactScan: return "exact_scan";
+    case SearchPlan::kWindowGraph: return "window_graph";
+    case SearchPlan::kTopLayer: return "top_layer";
+  }
+  return "unknown";
+}
+
+// per index search costs in ns, see WoWIndex::calibratePlanner. the defaults were measured on 32-d float vectors
+struct PlanCosts
+{
+  static constexpr size_t kReferenceDim = 32;
+
+  double scan_ns_{270};     // per element of an exact scan
+  double window_ns_{2000};  // per beam slot of a windowed graph search
+  double top_ns_{1500};     // per beam slot of an unfiltered top layer search
+
+  // the defaults grown with the distance computations of dim-dimensional vectors, until a calibration replaces them
+  static auto ForDimension(size_t dim) -> PlanCosts
+  {
+    PlanCosts costs;
+    double    scale = std::max<double>(dim, kReferenceDim) / kReferenceDim;
+    costs.scan_ns_ *= scale;
+    costs.window_ns_ *= scale;
+    costs.top_ns_ *= scale;
+    return costs;
+  }
+};
+
+// what is known about a range search before it starts
+struct PlanInput
+{
+  size_t card_;  // elements in the range
+  size_t num_;   // elements in the index
+  size_t efs_;
+};
+
+class QueryPlanner
+{
+public:
+  virtual ~QueryPlanner() = default;
+
+  virtual auto Plan(const PlanInput &in, const PlanCosts &costs) const -> SearchPlan = 0;
+};
+
+/**
+ * @brief picks the plan with the lowest estimated time
+ *
+ * a scan scores card elements. a windowed search fills a beam of efs, or of card if the range is smaller. the top
+ * layer search widens its beam to efs * num / card so that about efs of it pass the filter.
+ */
+class CostModelPlanner : public QueryPlanner
+{
+public:
+  auto Plan(const PlanInput &in, const PlanCosts &costs) const -> SearchPlan override
+  {
+    double scan   = costs.scan_ns_ * in.card_;
+    double window = costs.window_ns_ * std::min(in.efs_, in.card_);
+    double top    = in.card_ == 0 ? std::numeric_limits<double>::max()
+                                  : costs.top_ns_ * in.efs_ * ((double)in.num_ / in.card_);
+    if (scan <= window && scan <= top) {
+      return SearchPlan::kExactScan;
+    }
+    return top < window ? SearchPlan::kTopLayer : SearchPlan::kWindowGraph;
+  }
+};
+
+}  // namespace wowlib
@@ -0,0 +1,47 @@
+#pragma once
+#include <vector>
+#include "utils.hh"
+#include "visit_list.hh"
+#include "query_planner.hh"
+
+namespace wowlib {
+
+/**
+ * @brief scratch state of one in-flight search: the visited list, the two heaps, the entry point buffers and the
+ * quantizer's prepared query.
+ *
+ * a context is not thread safe, use one per thread. buffers keep their capacity between queries, so once
+ * warmed up a search does no allocation and takes no lock.
+ */
+class SearchContext
+{
+public:
+  explicit SearchContext(size_t max_elements) : visited_(max_elements) {}
+
+  SearchContext(const SearchContext &)            = delete;
+  SearchContext &operator=(const SearchContext &) = delete;
+
+  // preallocate the heaps for beam width ef
+  void Reserve(size_t ef)
+  {
+    result_.reserve(ef + 1);
+    candidates_.reserve(ef + 1);
+    eps_.reserve(ef);
+  }
+
+  inline __attribute__((always_inline)) auto Capacity() const -> size_t { return visited_.numelements_; }
+
+public:
+  VisitedList<tableint>     visited_;
+  std::vector<tableint>     ep_ids_;
+  std::vector<tableint>     scan_ids_;
+  std::vector<dist_id_pair> eps_;
+  std::vector<dist_id_pair> seeds_;
+  std::vector<dist_id_pair> result_;
+  std::vector<dist_id_pair> candidates_;
+  std::vector<char>         query_buf_;
+  std::vector<float>        query_float_;
+  SearchPlan                plan_{SearchPlan::kWindowGraph};  // how the last search was answered
+};
+
+}  // namespace wowlib
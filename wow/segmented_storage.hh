@@ -0,0 +1,151 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include "memory.hh"
+
+namespace wowlib {
+
+/**
+ * @brief fixed size records in equally sized segments reached through a segment table
+ *
+ * a segment holds a power of two records, so locating a record is a shift, a mask and one load from the (small,
+ * cache resident) table. growing appends zeroed segments and never moves a record. a contiguous region, e.g. a file
+ * mapping, can be adopted as the leading segments without a copy, adopted segments are not freed.
+ */
+class SegmentedStorage
+{
+  // segments of at least this size are 2MB aligned, smaller ones (small indexes) are allocated exactly
+  static constexpr size_t kHugeSegmentBytes = 1 << 21;
+  static constexpr size_t kMaxSegmentBytes  = 1 << 28;
+  static constexpr size_t kMinSegmentShift  = 10;
+
+public:
+  SegmentedStorage() = default;
+
+  ~SegmentedStorage() { Clear(); }
+
+  SegmentedStorage(const SegmentedStorage &)            = delete;
+  SegmentedStorage &operator=(const SegmentedStorage &) = delete;
+
+  /**
+   * @brief drop all records and set the layout
+   *
+   * segments hold about capacity / 16 records, so growing past the initial capacity allocates in steps of ~6% and
+   * the unused tail of the last segment stays small.
+   */
+  void Init(size_t record_size, size_t capacity)
+  {
+    Clear();
+    record_size_ = record_size;
+    shift_       = kMinSegmentShift;
+    while ((size_t(1) << (shift_ + 4)) < capacity && (record_size_ << (shift_ + 1)) <= kMaxSegmentBytes) {
+      ++shift_;
+    }
+    mask_ = (size_t(1) << shift_) - 1;
+  }
+
+  void Clear()
+  {
+    for (size_t i = 0; i < segments_.size(); ++i) {
+      if (owned_[i]) {
+        free(segments_[i]);
+      }
+    }
+    segments_.clear();
+    owned_.clear();
+    capacity_ = 0;
+  }
+
+  void Swap(SegmentedStorage &other)
+  {
+    std::swap(record_size_, other.record_size_);
+    std::swap(shift_, other.shift_);
+    std::swap(mask_, other.mask_);
+    std::swap(capacity_, other.capacity_);
+    segments_.swap(other.segments_);
+    owned_.swap(other.owned_);
+  }
+
+  inline __attribute__((always_inline)) auto At(size_t i) const -> char *
+  {
+    return segments_[i >> shift_] + (i & mask_) * record_size_;
+  }
+
+  inline __attribute__((always_inline)) auto Empty() const -> bool { return segments_.empty(); }
+  inline __attribute__((always_inline)) auto RecordSize() const -> size_t { return record_size_; }
+  inline __attribute__((always_inline)) auto Capacity() const -> size_t { return capacity_; }
+
+  // make records [0, n) addressable, new records are zero
+  void Grow(size_t n)
+  {
+    if (n <= capacity_) {
+      return;
+    }
+    size_t tail = capacity_ & mask_;
+    if (tail != 0) {
+      // the last adopted segment is partial, only this one is copied into a full segment
+      auto segment = Allocate();
+      memcpy(segment, segments_.back(), tail * record_size_);
+      segments_.back() = segment;
+      owned_.back()    = true;
+    }
+    capacity_ = segments_.size() << shift_;
+    while (capacity_ < n) {
+      segments_.emplace_back(Allocate());
+      owned_.emplace_back(true);
+      capacity_ += size_t(1) << shift_;
+    }
+  }
+
+  // view the n records stored contiguously at base as segments, base must outlive the storage
+  void Adopt(char *base, size_t n)
+  {
+    Clear();
+    size_t segment_bytes = record_size_ << shift_;
+    for (size_t i = 0; i < n; i += size_t(1) << shift_) {
+      segments_.emplace_back(base + (i >> shift_) * segment_bytes);
+      owned_.emplace_back(false);
+    }
+    capacity_ = n;
+  }
+
+  // records [0, n) as one contiguous block
+  void Write(std::ostream &os, size_t n) const
+  {
+    for (size_t i = 0; i < n; i += size_t(1) << shift_) {
+      os.write(At(i), std::min(n - i, size_t(1) << shift_) * record_size_);
+    }
+  }
+
+  void Read(std::istream &is, size_t n)
+  {
+    Grow(n);
+    for (size_t i = 0; i < n; i += size_t(1) << shift_) {
+      is.read(At(i), std::min(n - i, size_t(1) << shift_) * record_size_);
+    }
+  }
+
+private:
+  auto Allocate() const -> char *
+  {
+    size_t bytes   = record_size_ << shift_;
+    auto   segment = (char *)(bytes >= kHugeSegmentBytes ? glass::alloc2M(bytes) : glass::alloc64B(bytes));
+    if (segment == nullptr) {
+      throw std::runtime_error("Not enough memory: failed to allocate a storage segment");
+    }
+    return segment;
+  }
+
+  size_t              record_size_{0};
+  size_t              shift_{kMinSegmentShift};
+  size_t              mask_{(size_t(1) << kMinSegmentShift) - 1};
+  size_t              capacity_{0};
+  std::vector<char *> segments_;
+  std::vector<bool>   owned_;
+};
+
+}  // namespace wowlib
@@ -144,3 +144,4 @@ class SpaceInterface {
 
 #include "space_l2.hh"
 #include "space_ip.hh"
+#include "space_half.hh"
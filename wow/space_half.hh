@@ -0,0 +1,270 @@
+#pragma once
+#include "space_dist.hh"
+#include "disk.hh"
+#include <cstdint>
+
+namespace wowlib {
+
+// IEEE half precision, converted by the compiler (F16C when available)
+typedef _Float16 fp16_t;
+
+// bfloat16: the upper 16 bits of a float, rounded to nearest even on conversion
+struct bf16_t {
+    uint16_t bits_{0};
+
+    bf16_t() = default;
+
+    bf16_t(float f) {
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        if ((u & 0x7fffffff) > 0x7f800000) {
+            bits_ = (u >> 16) | 0x40;  // quiet NaN
+        } else {
+            bits_ = (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+        }
+    }
+
+    operator float() const {
+        uint32_t u = (uint32_t) bits_ << 16;
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+};
+
+// same size as fp16_t, tagged apart so an index file of one is not loaded as the other
+template<>
+struct TypeKind<bf16_t> {
+    static constexpr uint32_t value = 4;
+};
+
+template<typename half_t>
+static float
+HalfL2Sqr(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const half_t *pVect1 = (const half_t *) pVect1v;
+    const half_t *pVect2 = (const half_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    float res = 0;
+    for (size_t i = 0; i < qty; i++) {
+        float t = (float) pVect1[i] - (float) pVect2[i];
+        res += t * t;
+    }
+    return res;
+}
+
+template<typename half_t>
+static float
+HalfInnerProductDistance(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const half_t *pVect1 = (const half_t *) pVect1v;
+    const half_t *pVect2 = (const half_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    float res = 0;
+    for (size_t i = 0; i < qty; i++) {
+        res += (float) pVect1[i] * (float) pVect2[i];
+    }
+    return 1.0f - res;
+}
+
+#if defined(USE_AVX512)
+
+// 16 elements widened to float
+template<typename half_t>
+static inline __m512 HalfLoad16(const half_t *p);
+
+template<>
+inline __m512 HalfLoad16<fp16_t>(const fp16_t *p) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) p));
+}
+
+template<>
+inline __m512 HalfLoad16<bf16_t>(const bf16_t *p) {
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) p)), 16));
+}
+
+template<typename half_t>
+static float
+HalfL2SqrAVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const half_t *pVect1 = (const half_t *) pVect1v;
+    const half_t *pVect2 = (const half_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= qty; i += 16) {
+        __m512 diff = _mm512_sub_ps(HalfLoad16(pVect1 + i), HalfLoad16(pVect2 + i));
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+    }
+    float res = _mm512_reduce_add_ps(sum);
+    for (; i < qty; i++) {
+        float t = (float) pVect1[i] - (float) pVect2[i];
+        res += t * t;
+    }
+    return res;
+}
+
+template<typename half_t>
+static float
+HalfInnerProductDistanceAVX512(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const half_t *pVect1 = (const half_t *) pVect1v;
+    const half_t *pVect2 = (const half_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= qty; i += 16) {
+        sum = _mm512_fmadd_ps(HalfLoad16(pVect1 + i), HalfLoad16(pVect2 + i), sum);
+    }
+    float res = _mm512_reduce_add_ps(sum);
+    for (; i < qty; i++) {
+        res += (float) pVect1[i] * (float) pVect2[i];
+    }
+    return 1.0f - res;
+}
+
+#endif
+
+#if defined(__AVX2__) && defined(__F16C__)
+
+// 8 elements widened to float
+template<typename half_t>
+static inline __m256 HalfLoad8(const half_t *p);
+
+template<>
+inline __m256 HalfLoad8<fp16_t>(const fp16_t *p) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) p));
+}
+
+template<>
+inline __m256 HalfLoad8<bf16_t>(const bf16_t *p) {
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) p)), 16));
+}
+
+static inline float HalfReduceAdd8(__m256 v) {
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    return _mm_cvtss_f32(lo);
+}
+
+template<typename half_t>
+static float
+HalfL2SqrAVX2(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const half_t *pVect1 = (const half_t *) pVect1v;
+    const half_t *pVect2 = (const half_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= qty; i += 8) {
+        __m256 diff = _mm256_sub_ps(HalfLoad8(pVect1 + i), HalfLoad8(pVect2 + i));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+    }
+    float res = HalfReduceAdd8(sum);
+    for (; i < qty; i++) {
+        float t = (float) pVect1[i] - (float) pVect2[i];
+        res += t * t;
+    }
+    return res;
+}
+
+template<typename half_t>
+static float
+HalfInnerProductDistanceAVX2(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+    const half_t *pVect1 = (const half_t *) pVect1v;
+    const half_t *pVect2 = (const half_t *) pVect2v;
+    size_t qty = *((size_t *) qty_ptr);
+
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= qty; i += 8) {
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(HalfLoad8(pVect1 + i), HalfLoad8(pVect2 + i)));
+    }
+    float res = HalfReduceAdd8(sum);
+    for (; i < qty; i++) {
+        res += (float) pVect1[i] * (float) pVect2[i];
+    }
+    return 1.0f - res;
+}
+
+#endif
+
+// half_t: fp16_t or bf16_t, distances are accumulated in float
+template<typename half_t>
+class L2SpaceHalf : public SpaceInterface<float> {
+    DISTFUNC<float> fstdistfunc_;
+    size_t data_size_;
+    size_t dim_;
+
+ public:
+    L2SpaceHalf(size_t dim) {
+        fstdistfunc_ = HalfL2Sqr<half_t>;
+#if defined(USE_AVX512)
+        if (AVX512Capable()) {
+            fstdistfunc_ = HalfL2SqrAVX512<half_t>;
+        } else
+#endif
+        {
+#if defined(__AVX2__) && defined(__F16C__)
+            fstdistfunc_ = HalfL2SqrAVX2<half_t>;
+#endif
+        }
+        dim_ = dim;
+        data_size_ = dim * sizeof(half_t);
+    }
+
+    size_t get_data_size() {
+        return data_size_;
+    }
+
+    DISTFUNC<float> get_dist_func() {
+        return fstdistfunc_;
+    }
+
+    void *get_dist_func_param() {
+        return &dim_;
+    }
+
+    ~L2SpaceHalf() {}
+};
+
+template<typename half_t>
+class InnerProductSpaceHalf : public SpaceInterface<float> {
+    DISTFUNC<float> fstdistfunc_;
+    size_t data_size_;
+    size_t dim_;
+
+ public:
+    InnerProductSpaceHalf(size_t dim) {
+        fstdistfunc_ = HalfInnerProductDistance<half_t>;
+#if defined(USE_AVX512)
+        if (AVX512Capable()) {
+            fstdistfunc_ = HalfInnerProductDistanceAVX512<half_t>;
+        } else
+#endif
+        {
+#if defined(__AVX2__) && defined(__F16C__)
+            fstdistfunc_ = HalfInnerProductDistanceAVX2<half_t>;
+#endif
+        }
+        dim_ = dim;
+        data_size_ = dim * sizeof(half_t);
+    }
+
+    size_t get_data_size() {
+        return data_size_;
+    }
+
+    DISTFUNC<float> get_dist_func() {
+        return fstdistfunc_;
+    }
+
+    void *get_dist_func_param() {
+        return &dim_;
+    }
+
+    ~InnerProductSpaceHalf() {}
+};
+
+}  // namespace wowlib
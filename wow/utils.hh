@@ -1,10 +1,13 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <stdio.h>
-#include <unordered_set>
+#include <atomic>
+#include <thread>
+#include <random>
 #include <sys/mman.h>
 
 #define PUSH_HEAP(vec, ...)      \
@@ -36,12 +39,174 @@ struct wow_range
   inline __attribute__((always_inline)) auto Test(const att_t &att) const -> bool { return att >= l_ && att <= u_; }
 };
 
+/**
+ * @brief the attributes in set_, kept sorted and unique
+ *
+ * sets of up to kLinearSize attributes are tested by comparing against all of them without a branch, which the
+ * compiler vectorizes for arithmetic attributes, larger sets by binary search.
+ */
 template <typename att_t>
 struct wow_set
 {
-  std::unordered_set<att_t>                  set_;
-  void                                       Set(att_t i) { set_.insert(i); }
-  inline __attribute__((always_inline)) bool Test(att_t i) const { return set_.find(i) != set_.end(); }
+  static constexpr size_t kLinearSize = 16;
+
+  std::vector<att_t> set_;
+
+  void Set(const att_t &att)
+  {
+    auto it = std::lower_bound(set_.begin(), set_.end(), att);
+    if (it == set_.end() || *it != att) {
+      set_.insert(it, att);
+    }
+  }
+
+  inline __attribute__((always_inline)) auto Test(const att_t &att) const -> bool
+  {
+    if (set_.size() <= kLinearSize) {
+      bool hit = false;
+      for (const auto &key : set_) {
+        hit |= key == att;
+      }
+      return hit;
+    }
+    return std::binary_search(set_.begin(), set_.end(), att);
+  }
+};
+
+/**
+ * @brief the union of the intervals [l_[i], u_[i]], kept sorted and disjoint
+ *
+ * Test counts the lower bounds <= att, without a branch for up to kLinearSize intervals, and compares att with the
+ * upper bound of the last of them.
+ */
+template <typename att_t>
+struct wow_multi_range
+{
+  static constexpr size_t kLinearSize = 16;
+
+  std::vector<att_t> l_;
+  std::vector<att_t> u_;
+
+  // adds [l, u], merged with the intervals it overlaps. an empty interval (l > u) is ignored
+  void Add(const att_t &l, const att_t &u)
+  {
+    if (u < l) {
+      return;
+    }
+    size_t first = std::lower_bound(u_.begin(), u_.end(), l) - u_.begin();
+    size_t last  = std::upper_bound(l_.begin(), l_.end(), u) - l_.begin();
+    if (first == last) {
+      l_.insert(l_.begin() + first, l);
+      u_.insert(u_.begin() + first, u);
+      return;
+    }
+    // [first, last) overlap [l, u]
+    l_[first] = std::min(l_[first], l);
+    u_[first] = std::max(u_[last - 1], u);
+    l_.erase(l_.begin() + first + 1, l_.begin() + last);
+    u_.erase(u_.begin() + first + 1, u_.begin() + last);
+  }
+
+  inline __attribute__((always_inline)) auto Test(const att_t &att) const -> bool
+  {
+    size_t n = 0;
+    if (l_.size() <= kLinearSize) {
+      for (const auto &l : l_) {
+        n += l <= att;
+      }
+    } else {
+      n = std::upper_bound(l_.begin(), l_.end(), att) - l_.begin();
+    }
+    return n > 0 && att <= u_[n - 1];
+  }
+};
+
+/**
+ * @brief an attribute range as the order ranks l_ .. l_ + n_ - 1 of a frozen index, see WoWIndex::freeze
+ *
+ * the rank test is one unsigned compare on a dense array. att_ is the attribute range itself, for the elements
+ * without a rank (deleted) and the neighbor keys.
+ */
+template <typename att_t>
+struct wow_rank_range
+{
+  tableint         l_{0};
+  tableint         n_{0};
+  wow_range<att_t> att_;
+
+  inline __attribute__((always_inline)) auto Test(tableint rank) const -> bool { return rank - l_ < n_; }
+};
+
+// no filter, every element passes. searches with it run the top layer plan (SearchPlan::kTopLayer)
+struct wow_unfiltered
+{
+  template <typename att_t>
+  inline __attribute__((always_inline)) auto Test(const att_t &) const -> bool
+  {
+    return true;
+  }
+};
+
+/**
+ * @brief reader-writer lock with one reader counter per cache line
+ *
+ * readers only touch the slot of their thread, so concurrent lookups never bounce a shared line. a writer raises
+ * writer_, which turns new readers away, and waits until every slot has drained. works with std::shared_lock and
+ * std::unique_lock.
+ */
+class DistributedSharedMutex
+{
+  static constexpr size_t kSlots = 64;
+
+  struct alignas(64) Slot
+  {
+    std::atomic<int> readers_{0};
+  };
+
+public:
+  void lock_shared()
+  {
+    auto &slot = slots_[SlotIndex()];
+    while (true) {
+      slot.readers_.fetch_add(1);
+      if (!writer_.load()) {
+        return;
+      }
+      slot.readers_.fetch_sub(1, std::memory_order_release);
+      while (writer_.load(std::memory_order_relaxed)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void unlock_shared() { slots_[SlotIndex()].readers_.fetch_sub(1, std::memory_order_release); }
+
+  void lock()
+  {
+    bool expected = false;
+    while (!writer_.compare_exchange_weak(expected, true)) {
+      expected = false;
+      std::this_thread::yield();
+    }
+    for (auto &slot : slots_) {
+      while (slot.readers_.load() != 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void unlock() { writer_.store(false, std::memory_order_release); }
+
+private:
+  static inline __attribute__((always_inline)) auto SlotIndex() -> size_t
+  {
+    static std::atomic<size_t> next_slot{0};
+    thread_local size_t        slot = next_slot.fetch_add(1, std::memory_order_relaxed) % kSlots;
+    return slot;
+  }
+
+  alignas(64) std::atomic<bool> writer_{false};
+  Slot slots_[kSlots];
 };
 
 struct dist_id_pair
@@ -57,4 +222,11 @@ struct dist_id_pair
 
   bool operator>(const dist_id_pair &rhs) const { return dist_ > rhs.dist_; }
 };
+
+// generator of the calling thread, rand() takes a global lock that serializes concurrent searches
+inline auto ThreadRng() -> std::minstd_rand &
+{
+  thread_local std::minstd_rand rng(std::random_device{}());
+  return rng;
+}
 }  // namespace wowlib
\ No newline at end of file
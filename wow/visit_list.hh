@@ -126,6 +126,17 @@ public:
 
   void Init(size_t n) { n_ = n; }
 
+  // new size for every list handed out later, pooled lists of the old size are dropped
+  void Reset(size_t n)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto bs : pool_) {
+      delete bs;
+    }
+    pool_.clear();
+    n_ = n;
+  }
+
   inline __attribute__((always_inline)) auto Get() -> VisitedType *
   {
     std::lock_guard<std::mutex> lock(mtx_);